@@ -0,0 +1,334 @@
+/// Benchmarks of Rpc hot paths, based on Google Benchmark:
+///
+/// ```
+/// g++ -std=c++20 -O2 -DNDEBUG -I. benchmark.cpp -o rpc_benchmark -lbenchmark -lpthread
+/// ./rpc_benchmark --benchmark_format=json --benchmark_out=results.json
+/// ```
+/// `Call` measures the caller side down to `sendRpcPacket`, `Dispatch` the receiver side of a prepared
+/// packet, `RoundTrip` a whole call including the result, through the in-process queue, the shared
+/// memory ring and a Unix socket pair. Round trips report latency percentiles as `p50`, `p90` and `p99`
+/// counters in nanoseconds, every benchmark reports calls per second as `items_per_second`
+#include "rpc.h"
+#include "rpc_binary_payload.h"
+#include "rpc_shm_transport.h"
+#include "rpc_socket_transport.h"
+
+#include <benchmark/benchmark.h>
+
+#include <map>
+#include <string>
+#include <sys/socket.h>
+#include <unistd.h>
+
+using Payload = rpc::BinaryPayload;
+
+// argument shapes, each has a void and a value-returning signature
+
+struct Empty {
+    using Void = void();
+    using Value = int();
+    static auto call(auto& rpc) { return rpc(); }
+};
+
+struct Scalar {
+    using Void = void(int);
+    using Value = int(int);
+    static auto call(auto& rpc) { return rpc(42); }
+};
+
+struct String {
+    using Void = void(const std::string&);
+    using Value = int(const std::string&);
+    static const std::string& argument() {
+        static const std::string value(64, 'x');
+        return value;
+    }
+    static auto call(auto& rpc) { return rpc(argument()); }
+};
+
+struct Map {
+    using Void = void(const std::map<int, double>&);
+    using Value = int(const std::map<int, double>&);
+    static const std::map<int, double>& argument() {
+        static const auto value = [] {
+            std::map<int, double> map;
+            for (int i = 0; i < 16; ++i) {
+                map.emplace(i, i * 0.5);
+            }
+            return map;
+        }();
+        return value;
+    }
+    static auto call(auto& rpc) { return rpc(argument()); }
+};
+
+struct BenchConfig : rpc::DefaultConfig {
+    static constexpr std::size_t packetPoolSize = 64;
+    static constexpr bool concurrentCalls = true;
+};
+
+/// `Transport::send(interface, packet)` delivers packets, `Transport::pump` moves them between the sides
+template<class Transport>
+struct BenchInterface : rpc::RpcInterface<BenchInterface<Transport>, Payload, BenchConfig> {
+    template<typename Signature>
+    using Rpc = rpc::RpcCall<BenchInterface, Payload, BenchConfig, Signature>;
+
+    BenchInterface() {
+        emptyVoid = [] {};
+        emptyValue = [] { return 1; };
+        scalarVoid = [](int) {};
+        scalarValue = [](int v) { return v * v; };
+        stringVoid = [](const std::string&) {};
+        stringValue = [](const std::string& s) { return int(s.size()); };
+        mapVoid = [](const std::map<int, double>&) {};
+        mapValue = [](const std::map<int, double>& m) { return int(m.size()); };
+    }
+
+    template<typename R>
+    void sendRpcPacket(rpc::RpcPacket<Payload>&& packet) {
+        transport->send(*this, std::move(packet));
+    }
+
+    template<typename R>
+    void onResultReturned(rpc::CallId, const R& result) {
+        benchmark::DoNotOptimize(result);
+        ++results();
+    }
+
+    static std::size_t& results() {
+        thread_local std::size_t count = 0;
+        return count;
+    }
+
+    template<class Shape, bool value>
+    auto& member() {
+        if constexpr (std::is_same_v<Shape, Empty>) { return choose<value>(emptyVoid, emptyValue); }
+        else if constexpr (std::is_same_v<Shape, Scalar>) { return choose<value>(scalarVoid, scalarValue); }
+        else if constexpr (std::is_same_v<Shape, String>) { return choose<value>(stringVoid, stringValue); }
+        else { return choose<value>(mapVoid, mapValue); }
+    }
+
+    template<bool value, typename A, typename B>
+    static auto& choose(A& a, B& b) {
+        if constexpr (value) { return b; } else { return a; }
+    }
+
+    Transport* transport = nullptr;
+
+    Rpc<Empty::Void> emptyVoid = this;
+    Rpc<Empty::Value> emptyValue = this;
+    Rpc<Scalar::Void> scalarVoid = this;
+    Rpc<Scalar::Value> scalarValue = this;
+    Rpc<String::Void> stringVoid = this;
+    Rpc<String::Value> stringValue = this;
+    Rpc<Map::Void> mapVoid = this;
+    Rpc<Map::Value> mapValue = this;
+
+    using RpcMembers = rpc::RpcList<&BenchInterface::emptyVoid, &BenchInterface::emptyValue,
+                                    &BenchInterface::scalarVoid, &BenchInterface::scalarValue,
+                                    &BenchInterface::stringVoid, &BenchInterface::stringValue,
+                                    &BenchInterface::mapVoid, &BenchInterface::mapValue>;
+};
+
+/// Calls stay in per-thread queues, every thread of a multi-threaded benchmark has its own ones
+struct LocalTransport {
+    using Interface = BenchInterface<LocalTransport>;
+
+    template<class Side>
+    void send(Side& side, rpc::RpcPacket<Payload>&& packet) {
+        queue(&side == sender).push_back(std::move(packet));
+    }
+
+    void pump(Interface& receiver, Interface& caller, bool) {
+        dispatch(receiver, queue(true));
+        dispatch(caller, queue(false));
+    }
+
+    void dispatch(Interface& interface, std::vector<rpc::RpcPacket<Payload>>& packets) {
+        for (auto& packet : packets) {
+            interface.dispatch(packet);
+            Interface::releasePacket(std::move(packet));
+        }
+        packets.clear();
+    }
+
+    static std::vector<rpc::RpcPacket<Payload>>& queue(bool toReceiver) {
+        thread_local std::vector<rpc::RpcPacket<Payload>> queues[2];
+        return queues[toReceiver];
+    }
+
+    Interface* sender = nullptr;
+};
+
+struct ShmTransport {
+    using Interface = BenchInterface<ShmTransport>;
+
+    ShmTransport()
+        : server(rpc::ShmChannel<Payload>::create("rpc-benchmark", rpc::InstanceId(getpid()), 1 << 16, rpc::Wakeup::BusyPoll)),
+          client(rpc::ShmChannel<Payload>::open("rpc-benchmark", rpc::InstanceId(getpid()), rpc::Wakeup::BusyPoll)) {}
+
+    template<class Side>
+    void send(Side& side, rpc::RpcPacket<Payload>&& packet) {
+        auto& channel = &side == sender ? client : server;
+        while (!channel.send(packet)) {}
+        Interface::releasePacket(std::move(packet));
+    }
+
+    void pump(Interface& receiver, Interface& caller, bool) {
+        server.poll(receiver);
+        client.poll(caller);
+    }
+
+    rpc::ShmChannel<Payload> server;
+    rpc::ShmChannel<Payload> client;
+    Interface* sender = nullptr;
+};
+
+struct SocketTransport {
+    using Interface = BenchInterface<SocketTransport>;
+    using Connection = rpc::SocketConnection<Interface, Payload>;
+
+    SocketTransport() : server(makePair(clientFd)), client(clientFd) {}
+
+    static int makePair(int& other) {
+        int fds[2];
+        if (::socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) != 0) {
+            rpc::socket::throwError("socketpair");
+        }
+        other = fds[1];
+        return fds[0];
+    }
+
+    template<class Side>
+    void send(Side& side, rpc::RpcPacket<Payload>&& packet) {
+        (&side == sender ? client : server).send(std::move(packet));
+    }
+
+    // `receive` blocks, so the caller side reads only when a result is expected
+    void pump(Interface& receiver, Interface& caller, bool hasResult) {
+        server.receive(receiver);
+        if (hasResult) {
+            client.receive(caller);
+        }
+    }
+
+    int clientFd = -1;
+    Connection server;
+    Connection client;
+    Interface* sender = nullptr;
+};
+
+template<class Shape, bool value>
+void Call(benchmark::State& state) {
+    LocalTransport transport;
+    LocalTransport::Interface caller;
+    caller.transport = &transport;
+    transport.sender = &caller;
+    auto& queue = LocalTransport::queue(true);
+
+    for (auto _ : state) {
+        Shape::call(caller.template member<Shape, value>());
+        LocalTransport::Interface::releasePacket(std::move(queue.back()));
+        queue.pop_back();
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+
+template<class Shape, bool value>
+void Dispatch(benchmark::State& state) {
+    LocalTransport transport;
+    LocalTransport::Interface caller, receiver;
+    caller.transport = receiver.transport = &transport;
+    transport.sender = &caller;
+
+    Shape::call(caller.template member<Shape, value>());
+    const auto packet = std::move(LocalTransport::queue(true).back());
+    LocalTransport::queue(true).clear();
+    auto& responses = LocalTransport::queue(false);
+
+    for (auto _ : state) {
+        receiver.dispatch(packet);
+        if constexpr (value) {
+            LocalTransport::Interface::releasePacket(std::move(responses.back()));
+            responses.pop_back();
+        }
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+
+template<class Transport, class Shape, bool value>
+void RoundTrip(benchmark::State& state) {
+    // multi-threaded callers share interfaces, each thread pumps its own calls
+    static Transport* transport;
+    static typename Transport::Interface* caller;
+    static typename Transport::Interface* receiver;
+    if (state.thread_index() == 0) {
+        transport = new Transport;
+        caller = new typename Transport::Interface;
+        receiver = new typename Transport::Interface;
+        caller->transport = receiver->transport = transport;
+        transport->sender = caller;
+    }
+
+    std::vector<int64_t> latencies;
+    latencies.reserve(1 << 20);
+    auto& results = Transport::Interface::results();
+    // the barrier of the first iteration publishes the shared objects to other threads
+    for (auto _ : state) {
+        const auto start = std::chrono::steady_clock::now();
+        Shape::call(caller->template member<Shape, value>());
+        transport->pump(*receiver, *caller, value);
+        const auto end = std::chrono::steady_clock::now();
+        if (latencies.size() < latencies.capacity()) {
+            latencies.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count());
+        }
+    }
+    benchmark::DoNotOptimize(results);
+
+    std::sort(latencies.begin(), latencies.end());
+    auto percentile = [&](double p) {
+        return latencies.empty() ? 0.0 : double(latencies[std::size_t(p * double(latencies.size() - 1))]);
+    };
+    state.counters["p50"] = benchmark::Counter(percentile(0.5), benchmark::Counter::kAvgThreads);
+    state.counters["p90"] = benchmark::Counter(percentile(0.9), benchmark::Counter::kAvgThreads);
+    state.counters["p99"] = benchmark::Counter(percentile(0.99), benchmark::Counter::kAvgThreads);
+    state.SetItemsProcessed(state.iterations());
+
+    if (state.thread_index() == 0) {
+        delete receiver;
+        delete caller;
+        delete transport;
+    }
+}
+
+template<class Shape>
+void registerShape(const char* shape) {
+    const std::string name(shape);
+    for (const bool value : {false, true}) {
+        const std::string suffix = name + (value ? "/value" : "/void");
+        benchmark::RegisterBenchmark(("Call/" + suffix).c_str(), value ? Call<Shape, true> : Call<Shape, false>);
+        benchmark::RegisterBenchmark(("Dispatch/" + suffix).c_str(), value ? Dispatch<Shape, true> : Dispatch<Shape, false>);
+        benchmark::RegisterBenchmark(("RoundTrip/local/" + suffix).c_str(),
+                                     value ? RoundTrip<LocalTransport, Shape, true> : RoundTrip<LocalTransport, Shape, false>)
+            ->ThreadRange(1, 8)->UseRealTime();
+        benchmark::RegisterBenchmark(("RoundTrip/shm/" + suffix).c_str(),
+                                     value ? RoundTrip<ShmTransport, Shape, true> : RoundTrip<ShmTransport, Shape, false>);
+        benchmark::RegisterBenchmark(("RoundTrip/socket/" + suffix).c_str(),
+                                     value ? RoundTrip<SocketTransport, Shape, true> : RoundTrip<SocketTransport, Shape, false>);
+    }
+}
+
+int main(int argc, char** argv) {
+    registerShape<Empty>("empty");
+    registerShape<Scalar>("scalar");
+    registerShape<String>("string");
+    registerShape<Map>("map");
+
+    benchmark::Initialize(&argc, argv);
+    if (benchmark::ReportUnrecognizedArguments(argc, argv)) {
+        return 1;
+    }
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    return 0;
+}
@@ -0,0 +1,382 @@
+/// Multi-threaded stress tests of the lock-free tables and the Dispatcher, meant to be run under
+/// ThreadSanitizer as well as in a plain build:
+///
+/// ```
+/// g++ -std=c++20 -O1 -g -fsanitize=thread -I. concurrency_test.cpp -o rpc_concurrency_test -lpthread
+/// ./rpc_concurrency_test [name]
+/// ```
+/// Runs every test or only those whose name contains `name`. Prints failed checks,
+/// exit code is the number of failed tests
+#include "rpc_binary_payload.h"
+#include "rpc_dispatcher.h"
+#include "rpc_future.h"
+#include "rpc_pending_calls.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+namespace {
+
+std::atomic<int> failedChecks{0};
+
+#define CHECK(condition) \
+    do { \
+        if (!(condition)) { \
+            std::printf("  %s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #condition); \
+            ++failedChecks; \
+        } \
+    } while (false)
+
+constexpr int rounds = 100000;
+
+/// waits for another test thread, yielding as tests may run on fewer cores than threads
+template<typename F>
+void waitUntil(F&& done) {
+    while (!done()) {
+        std::this_thread::yield();
+    }
+}
+
+/// runs `f(thread index)` on `count` threads at once
+template<typename F>
+void runThreads(int count, F&& f) {
+    std::atomic<bool> go{false};
+    std::vector<std::thread> threads;
+    for (int i = 0; i < count; ++i) {
+        threads.emplace_back([&go, &f, i] {
+            waitUntil([&go] { return go.load(std::memory_order_acquire); });
+            f(i);
+        });
+    }
+    go.store(true, std::memory_order_release);
+    for (auto& thread : threads) {
+        thread.join();
+    }
+}
+
+struct ConcurrentConfig : rpc::DefaultConfig {
+    static constexpr bool concurrentCalls = true;
+    static constexpr rpc::CallId callIdBlockSize = 64;
+};
+
+struct ConcurrentInterface : rpc::RpcInterface<ConcurrentInterface, rpc::BinaryPayload, ConcurrentConfig> {
+    template<typename R>
+    void sendRpcPacket(rpc::RpcPacket<rpc::BinaryPayload>&&) {}
+};
+
+/// ids taken by many threads from one interface, in blocks and one by one, never repeat
+void concurrentCallIds() {
+    constexpr int threadCount = 4;
+    ConcurrentInterface interface;
+    ConcurrentInterface other;
+    std::vector<rpc::CallId> ids[threadCount];
+
+    runThreads(threadCount, [&](int thread) {
+        for (int i = 0; i < rounds / threadCount; ++i) {
+            ids[thread].push_back(interface.getNextCallId());
+            if (i % 3 == 0) {
+                other.getNextCallId(); // makes threads switch between cached blocks of instances
+            }
+        }
+    });
+
+    std::vector<rpc::CallId> all;
+    for (const auto& threadIds : ids) {
+        all.insert(all.end(), threadIds.begin(), threadIds.end());
+    }
+    std::sort(all.begin(), all.end());
+    CHECK(std::adjacent_find(all.begin(), all.end()) == all.end());
+    CHECK(std::find(all.begin(), all.end(), 0) == all.end());
+}
+
+/// values inserted on one thread and taken on another, with slots reused all the time
+void pendingCallsInsertTake() {
+    constexpr std::size_t capacity = 64;
+    rpc::PendingCalls<uint64_t, capacity> calls;
+    std::atomic<rpc::CallId> mailboxes[capacity] = {};
+    std::atomic<int> wrongValues{0};
+    std::atomic<int> failedInserts{0};
+
+    runThreads(2, [&](int thread) {
+        for (rpc::CallId callId = 1; callId <= rounds; ++callId) {
+            auto& mailbox = mailboxes[callId % capacity];
+            if (thread == 0) {
+                waitUntil([&] { return mailbox.load(std::memory_order_acquire) == 0; });
+                failedInserts.fetch_add(!calls.insert(callId, uint64_t(callId) * 3), std::memory_order_relaxed);
+                mailbox.store(callId, std::memory_order_release);
+            } else {
+                waitUntil([&] { return mailbox.load(std::memory_order_acquire) == callId; });
+                CHECK(!calls.take(callId + capacity)); // a later call of the same slot is not there
+                const auto value = calls.take(callId);
+                wrongValues.fetch_add(!value || *value != uint64_t(callId) * 3, std::memory_order_relaxed);
+                CHECK(!calls.take(callId));
+                mailbox.store(0, std::memory_order_release);
+            }
+        }
+    });
+
+    CHECK(wrongValues.load() == 0);
+    CHECK(failedInserts.load() == 0);
+}
+
+/// Slots acquired, completed, taken and released by many threads of a small table: a slot is never
+/// handed out twice, and releasing while another thread completes frees it exactly once
+void resultSlotsChurn() {
+    constexpr int threadCount = 4;
+    constexpr std::size_t capacity = 16;
+    rpc::ResultSlots<uint64_t, capacity> slots;
+    std::atomic<int> holders[capacity] = {};
+    std::atomic<rpc::CallId> mailboxes[threadCount] = {};
+    std::atomic<int> doubleGrants{0};
+    std::atomic<int> wrongResults{0};
+
+    runThreads(threadCount, [&](int thread) {
+        auto& partner = mailboxes[(thread + 1) % threadCount];
+        for (int i = 0; i < rounds / threadCount; ++i) {
+            // result of a partner call, it may already be released
+            if (const auto callId = mailboxes[thread].exchange(0, std::memory_order_acquire)) {
+                slots.complete(callId, uint64_t(callId));
+            }
+
+            std::optional<rpc::CallId> callId;
+            waitUntil([&] { return (callId = slots.acquire()).has_value(); });
+            auto& holder = holders[*callId % capacity];
+            doubleGrants.fetch_add(holder.fetch_add(1, std::memory_order_relaxed) != 0, std::memory_order_relaxed);
+
+            switch (i % 3) {
+            case 0: { // completed and taken here
+                CHECK(slots.complete(*callId, uint64_t(*callId) + 1));
+                CHECK(!slots.complete(*callId, uint64_t(0)));
+                holder.fetch_sub(1, std::memory_order_relaxed); // others may get the slot once it is taken
+                const auto result = slots.take(*callId);
+                wrongResults.fetch_add(!result || *result != uint64_t(*callId) + 1, std::memory_order_relaxed);
+                break;
+            }
+            case 1: // released before its result
+                holder.fetch_sub(1, std::memory_order_relaxed);
+                slots.release(*callId);
+                CHECK(!slots.complete(*callId, uint64_t(0)));
+                break;
+            default: // partner completes while this thread releases
+                partner.store(*callId, std::memory_order_release); // replaces one not picked up, it is released anyway
+                std::this_thread::yield();
+                holder.fetch_sub(1, std::memory_order_relaxed);
+                slots.release(*callId);
+                break;
+            }
+        }
+    });
+
+    CHECK(doubleGrants.load() == 0);
+    CHECK(wrongResults.load() == 0);
+    for (const auto& mailbox : mailboxes) {
+        if (const auto callId = mailbox.load()) {
+            CHECK(!slots.complete(callId, uint64_t(0))); // all of them are released
+        }
+    }
+    std::size_t acquired = 0;
+    while (slots.acquire()) {
+        ++acquired;
+    }
+    CHECK(acquired == capacity); // nothing leaked
+}
+
+/// continuation installed on the calling thread while the result comes on a dispatching one:
+/// every result reaches its continuation exactly once and every slot is freed
+void thenRacesComplete() {
+    rpc::ResultSlots<int, 4> slots;
+    std::atomic<rpc::CallId> mailbox{0};
+    std::atomic<int> continued{0};
+    std::atomic<int> wrongResults{0};
+    std::atomic<int> failedCompletes{0};
+    std::atomic<int> failedThens{0};
+
+    runThreads(2, [&](int thread) {
+        for (int i = 0; i < rounds; ++i) {
+            if (thread == 0) {
+                const auto callId = slots.acquire();
+                CHECK(callId);
+                if (!callId) {
+                    return;
+                }
+                mailbox.store(*callId, std::memory_order_release);
+                const bool installed = slots.then(*callId, [&, i](int&& result) {
+                    wrongResults.fetch_add(result != i, std::memory_order_relaxed);
+                    continued.fetch_add(1, std::memory_order_relaxed);
+                });
+                failedThens.fetch_add(!installed, std::memory_order_relaxed);
+                // the next round reuses a slot, wait for this one to be freed
+                waitUntil([&, i] { return continued.load(std::memory_order_acquire) == i + 1; });
+            } else {
+                rpc::CallId callId;
+                waitUntil([&] { return (callId = mailbox.exchange(0, std::memory_order_acquire)) != 0; });
+                failedCompletes.fetch_add(!slots.complete(callId, i), std::memory_order_relaxed);
+            }
+        }
+    });
+
+    CHECK(continued.load() == rounds);
+    CHECK(wrongResults.load() == 0);
+    CHECK(failedCompletes.load() == 0);
+    CHECK(failedThens.load() == 0);
+    for (int i = 0; i < 4; ++i) {
+        CHECK(slots.acquire()); // nothing is left Waiting
+    }
+}
+
+/// futures waited on by one thread and completed by another, interleaved with `then`
+void futureAcrossThreads() {
+    rpc::ResultSlots<int> slots;
+    constexpr int inFlight = 64;
+    std::atomic<rpc::CallId> mailboxes[inFlight] = {};
+    std::atomic<int> sum{0};
+    std::atomic<int> failedCompletes{0};
+
+    runThreads(2, [&](int thread) {
+        for (int i = 0; i < rounds / inFlight; ++i) {
+            if (thread == 0) {
+                std::vector<rpc::Future<int>> futures;
+                for (int j = 0; j < inFlight; ++j) {
+                    futures.emplace_back(slots, *slots.acquire());
+                    mailboxes[j].store(futures.back().getCallId(), std::memory_order_release);
+                }
+                for (int j = 0; j < inFlight; ++j) {
+                    if (j % 2) {
+                        CHECK(futures[j].get() == j);
+                    } else {
+                        CHECK(futures[j].then([&, j](int&& result) { sum.fetch_add(result == j, std::memory_order_relaxed); }));
+                    }
+                }
+                // continuations may still be running on the other thread
+                waitUntil([&, i] { return sum.load(std::memory_order_acquire) == (i + 1) * inFlight / 2; });
+            } else {
+                for (int j = 0; j < inFlight; ++j) {
+                    rpc::CallId callId;
+                    waitUntil([&] { return (callId = mailboxes[j].exchange(0, std::memory_order_acquire)) != 0; });
+                    failedCompletes.fetch_add(!slots.complete(callId, j), std::memory_order_relaxed);
+                }
+            }
+        }
+    });
+
+    CHECK(sum.load() == rounds / inFlight * inFlight / 2);
+    CHECK(failedCompletes.load() == 0);
+}
+
+struct DispatchedInterface : rpc::RpcInterface<DispatchedInterface, rpc::BinaryPayload> {
+    template<typename R>
+    void sendRpcPacket(rpc::RpcPacket<rpc::BinaryPayload>&&) {}
+
+    Rpc<void(int depth)> spawn = this;
+    Rpc<void(uint32_t poster, int sequence)> perKey = this;
+    Rpc<void(int sequence)> perFunction = this;
+
+    template<typename Call, typename ...Args>
+    static rpc::RpcPacket<rpc::BinaryPayload> packet(const Call& call, const Args&... args) {
+        rpc::RpcPacket<rpc::BinaryPayload> packet;
+        packet.functionId = call.getFunctionId();
+        packet.payload.serialize(args...);
+        return packet;
+    }
+};
+
+/// Packets posted from outside and from handlers, which keep them in their worker queues for others
+/// to steal. Everything posted is handled once, ordered Rpcs keep their order and run one at a time
+void dispatcherPostSteal() {
+    constexpr int posterCount = 2;
+    constexpr int perPoster = rounds / 10;
+    constexpr int spawnDepth = 6; // each spawn posts two more until depth 0
+
+    // handlers capture only this, to fit into the inline storage
+    struct State {
+        DispatchedInterface receiver;
+        rpc::Dispatcher<DispatchedInterface, rpc::BinaryPayload> dispatcher{receiver, 4};
+        std::atomic<int> spawned{0};
+        std::atomic<int> handled{0};
+        std::atomic<int> outOfOrder{0};
+        std::atomic<int> overlapping{0};
+        std::atomic<int> runningPerFunction{0};
+        int lastPerFunction = -1; // strands run one packet at a time, so it needs no atomic
+        std::atomic<int> lastPerKey[posterCount] = {-1, -1};
+    } state;
+    auto& receiver = state.receiver;
+    auto& dispatcher = state.dispatcher;
+
+    receiver.spawn = [&state](int depth) {
+        state.spawned.fetch_add(1, std::memory_order_relaxed);
+        if (depth != 0) {
+            state.dispatcher.post(DispatchedInterface::packet(state.receiver.spawn, depth - 1));
+            state.dispatcher.post(DispatchedInterface::packet(state.receiver.spawn, depth - 1));
+        }
+    };
+    receiver.perKey = [&state](uint32_t poster, int sequence) {
+        const int last = state.lastPerKey[poster].exchange(sequence, std::memory_order_relaxed);
+        state.outOfOrder.fetch_add(last != sequence - 1, std::memory_order_relaxed);
+        state.handled.fetch_add(1, std::memory_order_relaxed);
+    };
+    receiver.perFunction = [&state](int sequence) {
+        state.overlapping.fetch_add(state.runningPerFunction.fetch_add(1, std::memory_order_relaxed) != 0, std::memory_order_relaxed);
+        state.outOfOrder.fetch_add(sequence != state.lastPerFunction + 1, std::memory_order_relaxed);
+        state.lastPerFunction = sequence;
+        state.runningPerFunction.fetch_sub(1, std::memory_order_relaxed);
+        state.handled.fetch_add(1, std::memory_order_relaxed);
+    };
+    dispatcher.setOrdering(receiver.perFunction, rpc::Ordering::PerFunction);
+    dispatcher.orderByKey(receiver.perKey, [](const rpc::RpcPacket<rpc::BinaryPayload>& packet) {
+        return uint64_t(std::get<0>(packet.payload.deserialize<std::tuple<uint32_t, int>>()));
+    });
+
+    runThreads(posterCount, [&](int thread) {
+        for (int i = 0; i < perPoster; ++i) {
+            dispatcher.post(DispatchedInterface::packet(receiver.perKey, uint32_t(thread), i));
+            if (thread == 0) {
+                dispatcher.post(DispatchedInterface::packet(receiver.perFunction, i));
+            }
+            if (i % 256 == 0) {
+                dispatcher.post(DispatchedInterface::packet(receiver.spawn, spawnDepth));
+            }
+        }
+    });
+    dispatcher.waitIdle();
+
+    const int spawnRoots = posterCount * ((perPoster + 255) / 256);
+    CHECK(state.spawned.load() == spawnRoots * ((1 << (spawnDepth + 1)) - 1));
+    CHECK(state.handled.load() == posterCount * perPoster + perPoster);
+    CHECK(state.outOfOrder.load() == 0);
+    CHECK(state.overlapping.load() == 0);
+}
+
+struct Test {
+    const char* name;
+    void (*run)();
+};
+
+const Test tests[] = {
+    {"concurrentCallIds", concurrentCallIds},
+    {"pendingCallsInsertTake", pendingCallsInsertTake},
+    {"resultSlotsChurn", resultSlotsChurn},
+    {"thenRacesComplete", thenRacesComplete},
+    {"futureAcrossThreads", futureAcrossThreads},
+    {"dispatcherPostSteal", dispatcherPostSteal},
+};
+
+} // namespace
+
+int main(int argc, char** argv) {
+    int failedTests = 0;
+    for (const auto& test : tests) {
+        if (argc > 1 && !std::strstr(test.name, argv[1])) {
+            continue;
+        }
+        std::printf("%s\n", test.name);
+        const int failedBefore = failedChecks;
+        test.run();
+        failedTests += failedChecks != failedBefore;
+    }
+    std::printf(failedTests ? "%d tests failed\n" : "all tests passed\n", failedTests);
+    return failedTests;
+}
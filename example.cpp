@@ -1,9 +1,9 @@
 #include "rpc.h"
+#include "rpc_pending_calls.h"
 
 #include <iostream>
 #include <string>
 #include <vector>
-#include <deque>
 #include <thread>
 #include <future>
 #include <any>
@@ -40,13 +40,15 @@ struct LocalPayload {
 };
 
 /// to simplyfy the example we just store `packets` inside this dummy queue
-static std::map<rpc::InstanceId, std::deque<rpc::RpcPacket<LocalPayload>>> dummyQueue;
+static std::map<rpc::InstanceId, std::vector<rpc::RpcPacket<LocalPayload>>> dummyQueue;
 
 
 /// This is our interface base where we define:
 /// 1. how to send packets
 /// 2. how to deal with received rpc results
-struct LocalRpcInterface : public rpc::RpcInterface<LocalRpcInterface, LocalPayload> {
+/// `Derived` is the final interface type, so that `rpc::RpcInterface` can see its `RpcMembers`
+template<class Derived>
+struct LocalRpcInterface : public rpc::RpcInterface<Derived, LocalPayload> {
 
     /// Mandatory customization point #2 - Packet sending
     /// `template<typename R> auto sendRpcPacket(rpc::RpcPacket<LocalPayload>&& packet)` is invoked to send serialized RpcPacket
@@ -67,7 +69,7 @@ struct LocalRpcInterface : public rpc::RpcInterface<LocalRpcInterface, LocalPayl
             auto promise = std::shared_ptr<std::promise<R>>(new std::promise<R>);
             auto future = promise->get_future();
 
-            promises[packet.callId] = std::move(promise);
+            promises.insert(packet.callId, std::move(promise));
             return std::move(future);
         }
     }
@@ -80,21 +82,30 @@ struct LocalRpcInterface : public rpc::RpcInterface<LocalRpcInterface, LocalPayl
     /// When we receive result with callId, we set corresponding promise value
     template<typename R>
     void onResultReturned(uint32_t callId, const R& result) {
-        std::any_cast<std::shared_ptr<std::promise<R>>>(promises[callId])->set_value(result);
+        if (auto promise = promises.take(callId)) {
+            std::any_cast<std::shared_ptr<std::promise<R>>>(*promise)->set_value(result);
+        }
     }
 
-    std::unordered_map<uint32_t, std::any> promises;
+    // lock-free table, so calls may be done from many threads with `concurrentCalls` config
+    rpc::PendingCalls<std::any, 1024> promises;
 };
 
 
 /// Actual definitions of Rpc methods
-struct ExampleInterface : public LocalRpcInterface {
+struct ExampleInterface : public LocalRpcInterface<ExampleInterface> {
     // strange constructor `= this` helps to register calls for this interface
     Rpc<void(int id, const std::string& name, double money)> addAccount = this;
     Rpc<void(const std::map<std::string, int>& phonebook)> addPhonebook = this;
     Rpc<void()> notifyOne = this;
     Rpc<void()> notifyTwo = this;
     Rpc<int(int v)> square = this;
+
+    // optional: with members listed here FunctionIds are known at compile time
+    // and `dispatch` uses a static table instead of per-instance handler containers
+    using RpcMembers = rpc::RpcList<&ExampleInterface::addAccount, &ExampleInterface::addPhonebook,
+                                    &ExampleInterface::notifyOne, &ExampleInterface::notifyTwo,
+                                    &ExampleInterface::square>;
 };
 
 
@@ -153,10 +164,8 @@ int main() {
     // receiver handled `square` call, and returned result but it's not handled by sender yet and the future is pending
     assert(future.wait_for(std::chrono::seconds(0)) == std::future_status::timeout);
 
-    // loop over packets from receiver
-    for (const auto& packet : dummyQueue[receiverId]) {
-        sender.dispatch(packet);
-    }
+    // packets from receiver can be dispatched in one go
+    sender.dispatchBatch(dummyQueue[receiverId]);
     // now the future is ready
     std::cout << "Sender square: " << future.get() << "\n"; // => 25
 }
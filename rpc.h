@@ -1,8 +1,25 @@
 #pragma once
+#include <cstddef>
+#include <cstdint>
 #include <tuple>
-#include <vector>
 #include <unordered_map>
+#include <utility>
+#include <vector>
+#include <mutex>
 #include <functional>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cassert>
+#include <cstring>
+#include <memory_resource>
+#include <new>
+#include <memory>
+#include <optional>
+#include <span>
+#include <string_view>
 
 namespace rpc {
 
@@ -10,14 +27,321 @@ using CallId = uint32_t;
 using InstanceId = uint16_t;
 using FunctionId = uint16_t;
 
+enum class CallType : uint8_t {
+    Call,
+    Response,
+    Cancel ///< asks the receiver to drop call `callId`, see `RpcCall::cancel`
+};
+
+/// number of `CallType` values, anything above is rejected by wire header decoding
+inline constexpr uint8_t callTypeCount = 3;
+
+/// Time a call should be handled by, see `Config::deadlines`. Default-constructed one means no deadline
+using Deadline = std::chrono::steady_clock::time_point;
+inline constexpr Deadline noDeadline{};
+
+/// the earlier of two deadlines, `noDeadline` is later than any other
+constexpr Deadline earliest(Deadline a, Deadline b) {
+    return a == noDeadline ? b : b == noDeadline ? a : std::min(a, b);
+}
+
+/// Deadline calls made on this thread inherit. While a call with a deadline is handled it is the
+/// deadline of that call, so calls made by handlers do not outlive their callers
+inline Deadline& currentDeadline() {
+    thread_local Deadline deadline = noDeadline;
+    return deadline;
+}
+
+/// Limits deadlines of calls made on this thread until the end of a scope:
+///
+/// ```
+/// {
+///     rpc::DeadlineScope scope(std::chrono::steady_clock::now() + 50ms);
+///     auto future = caller.square(5);
+/// }
+/// ```
+/// Nested scopes can only make the deadline earlier
+class DeadlineScope {
+public:
+    explicit DeadlineScope(Deadline deadline) : previous(currentDeadline()) {
+        currentDeadline() = earliest(previous, deadline);
+    }
+    ~DeadlineScope() { currentDeadline() = previous; }
+
+    DeadlineScope(const DeadlineScope&) = delete;
+    DeadlineScope& operator = (const DeadlineScope&) = delete;
+
+private:
+    Deadline previous;
+};
+
 template<typename ...Args>
 using ArgsTuple = std::tuple<std::remove_cv_t<std::remove_reference_t<Args>>...>;
 
-enum class CallType {
-    Call,
-    Response
+/// Argument types referring to memory they don't own. Rpcs may declare them to let handlers read
+/// arguments straight from packet payload, they are valid only during a handler call.
+/// Payloads may specialize it for their own view types
+template<typename T> inline constexpr bool isArgumentView = false;
+template<typename Char, typename Traits> inline constexpr bool isArgumentView<std::basic_string_view<Char, Traits>> = true;
+template<typename T, std::size_t N> inline constexpr bool isArgumentView<std::span<T, N>> = true;
+
+/// Memory resource payloads should allocate deserialized arguments from.
+/// It is the default resource unless an `ArgumentArena` is active on this thread
+inline std::pmr::memory_resource*& currentArgumentResource() {
+    thread_local std::pmr::memory_resource* resource = nullptr;
+    return resource;
+}
+
+inline std::pmr::memory_resource* argumentResource() {
+    auto* resource = currentArgumentResource();
+    return resource ? resource : std::pmr::get_default_resource();
+}
+
+/// Makes payloads allocate deserialized arguments from `resource` until the end of a scope.
+/// Usually it is a monotonic arena released at once after a whole batch is dispatched:
+///
+/// ```
+/// std::pmr::monotonic_buffer_resource arena(buffer, sizeof(buffer));
+/// {
+///     rpc::ArgumentArena scope(arena);
+///     receiver.dispatchBatch(packets);
+/// }
+/// arena.release();
+/// ```
+/// Only allocator-aware argument types (`std::pmr::string`, `std::pmr::vector` etc.) can use it,
+/// handlers should not keep references to such arguments
+class ArgumentArena {
+public:
+    explicit ArgumentArena(std::pmr::memory_resource& resource) : previous(currentArgumentResource()) {
+        currentArgumentResource() = &resource;
+    }
+    ~ArgumentArena() { currentArgumentResource() = previous; }
+
+    ArgumentArena(const ArgumentArena&) = delete;
+    ArgumentArena& operator = (const ArgumentArena&) = delete;
+
+private:
+    std::pmr::memory_resource* previous;
+};
+
+/// Passes a call argument as is if it already has the declared argument type, converts it otherwise.
+/// This way payload always serializes declared types without copying caller objects
+template<typename Arg, typename CallArg>
+inline decltype(auto) forwardAs(CallArg&& arg) {
+    if constexpr (std::is_same_v<std::remove_cvref_t<CallArg>, std::remove_cvref_t<Arg>>) {
+        return std::forward<CallArg>(arg);
+    } else {
+        return std::remove_cvref_t<Arg>(std::forward<CallArg>(arg));
+    }
+}
+
+/// `CallArgs` can be passed where `Args` are declared
+template<typename ArgsList, typename ...CallArgs> inline constexpr bool isCallableWith = false;
+template<typename ...Args, typename ...CallArgs> requires (sizeof...(Args) == sizeof...(CallArgs))
+inline constexpr bool isCallableWith<void(Args...), CallArgs...> = (std::is_convertible_v<CallArgs&&, Args> && ...);
+
+/// Statistics hooks of an `RpcInterface`, called on its hot paths. This one does nothing and is
+/// compiled out, `rpc_stats.h` provides `rpc::RpcStats` collecting per-Rpc counters and histograms.
+/// Hooks are called concurrently if the interface is used from many threads
+struct NoStats {
+    /// handler time is measured only when enabled
+    static constexpr bool enabled = false;
+
+    void addFunction(FunctionId) {}
+    void onSent(FunctionId, CallType, std::size_t /*payloadBytes*/) {}
+    void onCallStarted(FunctionId, CallId) {}
+    /// `sendRpcPacket` has given call `previous` its own id
+    void onCallIdChanged(FunctionId, CallId /*previous*/, CallId) {}
+    void onReceived(FunctionId, CallType, std::size_t /*payloadBytes*/) {}
+    void onHandled(FunctionId, std::chrono::nanoseconds) {}
+    void onResultReturned(FunctionId, CallId) {}
+};
+
+/// Payload size reported to statistics, payloads expose it through `bytes()` or `size()`
+template<typename Payload>
+std::size_t payloadSize(const Payload& payload) {
+    if constexpr (requires { payload.bytes().size(); }) {
+        return payload.bytes().size();
+    } else if constexpr (requires { payload.size(); }) {
+        return payload.size();
+    } else {
+        return 0;
+    }
+}
+
+/// Compile-time settings of an `RpcInterface`.
+/// Derive from it and override only needed fields:
+///
+/// ```
+/// struct MyConfig : rpc::DefaultConfig {
+///     static constexpr std::size_t callbackCapacity = 64;
+/// };
+/// ```
+struct DefaultConfig {
+    /// inline storage size for bound Rpc handlers. Larger functors fail to compile
+    static constexpr std::size_t callbackCapacity = 4 * sizeof(void*);
+
+    /// maximum number of free packets kept per thread by `PacketPool`, 0 disables pooling.
+    /// Pooling requires `Payload::clear()` that drops content but keeps allocated memory
+    static constexpr std::size_t packetPoolSize = 0;
+
+    /// makes `getNextCallId` thread-safe, so that a single interface can be called from many threads.
+    /// Coalesced Rpcs still should be called from a single thread
+    static constexpr bool concurrentCalls = false;
+
+    /// With `concurrentCalls` each thread takes ranges of this many ids at once to avoid
+    /// contention on a shared counter. Ids are then unique but not ordered across threads.
+    /// A thread keeps ranges of up to `callIdBlockCacheSize` instances, ids left in a range are
+    /// lost when another instance takes its place, or when the thread exits. Ids are 32-bit and
+    /// wrap around, so they are unique among calls that are outstanding at the same time only
+    static constexpr CallId callIdBlockSize = 1;
+    static constexpr std::size_t callIdBlockCacheSize = 16;
+
+    /// calls of Rpcs without result take no call id and are sent with `callId` 0,
+    /// transports may then use the short wire header for them (see `wire::writeCompactHeader`)
+    static constexpr bool oneWayCalls = false;
+
+    /// statistics collected by the interface, e.g. `rpc::RpcStats<>` from `rpc_stats.h`
+    using Stats = NoStats;
+
+    /// Calls carry the deadline of `DeadlineScope` or `RpcCall::setTimeout`, whichever is earlier,
+    /// and receivers skip calls that are past their deadline without decoding them
+    static constexpr bool deadlines = false;
+};
+
+/// Move-only `std::function` replacement that never allocates.
+/// Functor is stored inside `Capacity` bytes of inline storage
+template<typename Signature, std::size_t Capacity> class InplaceFunction;
+
+template<typename R, typename ...Args, std::size_t Capacity>
+class InplaceFunction<R(Args...), Capacity> {
+public:
+    InplaceFunction() = default;
+
+    template<typename Functor, typename = std::enable_if_t<!std::is_same_v<std::decay_t<Functor>, InplaceFunction>>>
+    InplaceFunction(Functor&& f) {
+        using F = std::decay_t<Functor>;
+        static_assert(sizeof(F) <= Capacity, "Functor is too big for InplaceFunction, increase `callbackCapacity`");
+        static_assert(alignof(F) <= alignof(std::max_align_t), "Functor alignment is not supported");
+        static_assert(std::is_invocable_r_v<R, F&, Args...>, "Functor should be invocable with Rpc arguments");
+
+        ::new (static_cast<void*>(storage)) F(std::forward<Functor>(f));
+        invoker = [](void* self, Args&&... args) -> R {
+            return (*static_cast<F*>(self))(std::forward<Args>(args)...);
+        };
+        manager = &manage<F>;
+    }
+
+    /// binds member function `Method` of `object`, only the object pointer is stored
+    template<auto Method, class Object>
+    static InplaceFunction bind(Object* object) {
+        static_assert(sizeof(Object*) <= Capacity);
+        InplaceFunction function;
+        ::new (static_cast<void*>(function.storage)) Object*(object);
+        function.invoker = [](void* self, Args&&... args) -> R {
+            return ((*static_cast<Object**>(self))->*Method)(std::forward<Args>(args)...);
+        };
+        function.manager = &manage<Object*>;
+        return function;
+    }
+
+    InplaceFunction(InplaceFunction&& other) noexcept {
+        moveFrom(other);
+    }
+
+    InplaceFunction& operator = (InplaceFunction&& other) noexcept {
+        if (this != &other) {
+            reset();
+            moveFrom(other);
+        }
+        return *this;
+    }
+
+    InplaceFunction(const InplaceFunction&) = delete;
+    InplaceFunction& operator = (const InplaceFunction&) = delete;
+
+    ~InplaceFunction() { reset(); }
+
+    explicit operator bool() const { return invoker != nullptr; }
+
+    /// arguments are passed on by reference, by-value arguments are copied only from lvalues
+    template<typename ...CallArgs>
+        requires (sizeof...(CallArgs) == sizeof...(Args))
+    R operator() (CallArgs&&... args) const {
+        if (!invoker) {
+            throw std::bad_function_call();
+        }
+        return invoker(const_cast<unsigned char*>(storage), pass<Args>(std::forward<CallArgs>(args))...);
+    }
+
+private:
+    // binds an argument to `Arg&&` of the invoker, other types are converted by the call itself
+    template<typename Arg, typename CallArg>
+    static decltype(auto) pass(CallArg&& arg) {
+        if constexpr (!std::is_reference_v<Arg> && std::is_same_v<std::remove_cvref_t<CallArg>, Arg> && !std::is_same_v<CallArg, Arg>) {
+            return Arg(std::forward<CallArg>(arg)); // an lvalue can't bind to `Arg&&`, copy it as a by-value parameter would
+        } else {
+            return std::forward<CallArg>(arg);
+        }
+    }
+
+    template<typename F>
+    static void manage(void* dst, void* src) {
+        if (dst) {
+            ::new (dst) F(std::move(*static_cast<F*>(src)));
+        }
+        static_cast<F*>(src)->~F();
+    }
+
+    void reset() {
+        if (manager) {
+            manager(nullptr, storage);
+        }
+        invoker = nullptr;
+        manager = nullptr;
+    }
+
+    void moveFrom(InplaceFunction& other) {
+        if (other.manager) {
+            other.manager(storage, other.storage);
+        }
+        invoker = other.invoker;
+        manager = other.manager;
+        other.invoker = nullptr;
+        other.manager = nullptr;
+    }
+
+    alignas(std::max_align_t) unsigned char storage[Capacity];
+    R(*invoker)(void*, Args&&...) = nullptr;
+    // moves functor from `src` to `dst` and destroys it in `src`. Only destroys if `dst` is null
+    void(*manager)(void* dst, void* src) = nullptr;
+};
+
+/// Per-packet result of `RpcInterface::dispatchBatch`
+enum class DispatchStatus : uint8_t {
+    Ok,
+    UnknownFunction,
+    HandlerFailed,
+    UnknownInstance ///< set by `InstanceRouter`
 };
 
+inline void prefetch(const void* address) {
+#if defined(__GNUC__) || defined(__clang__)
+    __builtin_prefetch(address);
+#else
+    (void)address;
+#endif
+}
+
+/// spin-wait hint
+inline void cpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#endif
+}
+
 /// Packet generated on an RPC call
 /// `Payload` shoud be customized by user.
 /// `Payload` should have 2 special functions:
@@ -34,117 +358,1823 @@ enum class CallType {
 /// ```
 /// this will be called to get Tuple of arguments from payload
 /// Tuple is std::tuple of non-const/volatile non-reference `Args...`
+/// Tuple may contain views (see `isArgumentView`) pointing into the payload, the packet outlives handler call
 template<typename Payload>
 struct RpcPacket {
     InstanceId instanceId = 0;
     FunctionId functionId = 0;
     CallId callId = 0;
     CallType callType = CallType::Call;
+    Deadline deadline = noDeadline; ///< set for calls with `Config::deadlines`
     Payload payload;
 };
 
-template <class Interface, typename Payload, typename Signature> struct RpcCall;
+/// Fixed 8-byte wire layout of packet headers, a little-endian `uint64_t`:
+///
+/// ```
+/// bits  0..15  instanceId
+/// bits 16..29  functionId
+/// bits 30..31  callType
+/// bits 32..63  callId
+/// ```
+/// so transports read and write a header with a single load or store. The compact form drops `callId`
+/// of calls without one and without a deadline (see `Config::oneWayCalls`), they take the low 4 bytes only,
+/// with callType bits set to `oneWayCallType`. Deadlines are not part of the header, transports carry
+/// them as `deadlineSize` bytes of time left and flag them in their own framing. The varint form stores `instanceId`, `functionId << 2 | callType`
+/// and `callId` as LEB128, taking 3 bytes for small ids.
+/// Payload bytes are not covered, their encoding is up to the `Payload`
+namespace wire {
 
-template<class Interface, typename Payload>
-class RpcInterface {
-public:
+inline constexpr std::size_t headerSize = 8;
+inline constexpr std::size_t shortHeaderSize = 4;
+inline constexpr uint8_t oneWayCallType = 3;
+static_assert(callTypeCount <= oneWayCallType, "call types should leave room for the short header marker");
+inline constexpr std::size_t maxVarintHeaderSize = 3 + 3 + 5;
+inline constexpr std::size_t deadlineSize = 4;
+inline constexpr unsigned functionIdBits = 14;
+inline constexpr FunctionId maxFunctionId = (1u << functionIdBits) - 1;
 
-    template<typename Signature>
-    using Rpc = RpcCall<Interface, Payload, Signature>;
+/// converts between host and little-endian byte order, both ways
+template<typename T> requires std::is_unsigned_v<T>
+constexpr T toLittleEndian(T value) {
+    if constexpr (std::endian::native == std::endian::little) {
+        return value;
+    } else {
+        T swapped = 0;
+        for (std::size_t i = 0; i < sizeof(T); ++i) {
+            swapped = T(swapped << 8) | T((value >> (8 * i)) & 0xff);
+        }
+        return swapped;
+    }
+}
 
-    template<typename ReturnType, typename ...Args>
-    void registerCall(RpcCall<Interface, Payload, ReturnType(Args...)>& call) {
-        call.functionId = static_cast<FunctionId>(callHandlers.size());
-        call.interface = this;
-        callHandlers.emplace_back(std::make_pair(&call, call.makeCallHandler()));
+template<typename Payload>
+constexpr uint64_t packHeader(const RpcPacket<Payload>& packet) {
+    assert(packet.functionId <= maxFunctionId);
+    return uint64_t(packet.instanceId)
+         | uint64_t(packet.functionId) << 16
+         | uint64_t(packet.callType) << 30
+         | uint64_t(packet.callId) << 32;
+}
+
+/// fills packet header fields, returns false for an invalid call type
+template<typename Payload>
+constexpr bool unpackHeader(uint64_t header, RpcPacket<Payload>& packet) {
+    const auto callType = uint8_t((header >> 30) & 3);
+    packet.instanceId = InstanceId(header);
+    packet.functionId = FunctionId((header >> 16) & maxFunctionId);
+    packet.callType = CallType(callType);
+    packet.callId = CallId(header >> 32);
+    return callType < callTypeCount;
+}
+
+template<typename Payload>
+void writeHeader(const RpcPacket<Payload>& packet, std::byte* out) {
+    const uint64_t header = toLittleEndian(packHeader(packet));
+    std::memcpy(out, &header, headerSize);
+}
+
+/// reads `headerSize` bytes, returns false if the header is not valid
+template<typename Payload>
+bool readHeader(const std::byte* in, RpcPacket<Payload>& packet) {
+    uint64_t header;
+    std::memcpy(&header, in, headerSize);
+    return unpackHeader(toLittleEndian(header), packet);
+}
+
+/// calls with `callId` 0 need no call id on the wire, unless they have a deadline
+template<typename Payload>
+constexpr std::size_t compactHeaderSize(const RpcPacket<Payload>& packet) {
+    return packet.callType == CallType::Call && packet.callId == 0 && packet.deadline == noDeadline ? shortHeaderSize : headerSize;
+}
+
+/// Microseconds left until `deadline`, 0 for no deadline, so peers need no common clock. Time in
+/// transit is not accounted for. Expired deadlines are sent as 1, longer than 71 minutes are cut
+inline uint32_t packDeadline(Deadline deadline, Deadline now) {
+    if (deadline == noDeadline) {
+        return 0;
+    }
+    const auto left = std::chrono::duration_cast<std::chrono::microseconds>(deadline - now).count();
+    return uint32_t(std::clamp<int64_t>(left, 1, ~uint32_t(0)));
+}
+
+inline Deadline unpackDeadline(uint32_t left, Deadline now) {
+    return left != 0 ? now + std::chrono::microseconds(left) : noDeadline;
+}
+
+/// size of a compact header starting at `in`, known from its first `shortHeaderSize` bytes
+inline std::size_t compactHeaderSize(const std::byte* in) {
+    uint32_t low;
+    std::memcpy(&low, in, shortHeaderSize);
+    return ((toLittleEndian(low) >> 30) & 3) == oneWayCallType ? shortHeaderSize : headerSize;
+}
 
-        if constexpr (!std::is_same_v<void, ReturnType>) {
-            resultHandlers[call.functionId] = call.makeResultHandler();
+/// writes `compactHeaderSize(packet)` bytes and returns that size
+template<typename Payload>
+std::size_t writeCompactHeader(const RpcPacket<Payload>& packet, std::byte* out) {
+    if (compactHeaderSize(packet) == headerSize) {
+        writeHeader(packet, out);
+        return headerSize;
+    }
+    const uint32_t header = toLittleEndian(uint32_t(packHeader(packet)) | uint32_t(oneWayCallType) << 30);
+    std::memcpy(out, &header, shortHeaderSize);
+    return shortHeaderSize;
+}
+
+/// reads `compactHeaderSize(in)` bytes, returns false if the header is not valid
+template<typename Payload>
+bool readCompactHeader(const std::byte* in, RpcPacket<Payload>& packet) {
+    if (compactHeaderSize(in) == headerSize) {
+        return readHeader(in, packet);
+    }
+    uint32_t header;
+    std::memcpy(&header, in, shortHeaderSize);
+    unpackHeader(toLittleEndian(header) & ~(uint32_t(3) << 30), packet);
+    return true;
+}
+
+inline std::size_t writeVarint(uint32_t value, std::byte* out) {
+    std::size_t size = 0;
+    while (value >= 0x80) {
+        out[size++] = std::byte(value | 0x80);
+        value >>= 7;
+    }
+    out[size++] = std::byte(value);
+    return size;
+}
+
+/// returns the number of bytes read, 0 if `in` ends first or value does not fit `maxBits`
+inline std::size_t readVarint(std::span<const std::byte> in, uint32_t& value, unsigned maxBits) {
+    value = 0;
+    for (std::size_t i = 0; i < in.size() && 7 * i < maxBits; ++i) {
+        const auto byte = uint32_t(in[i]);
+        const unsigned bitsLeft = maxBits - 7 * unsigned(i);
+        if (bitsLeft < 7 && ((byte & 0x7f) >> bitsLeft) != 0) {
+            return 0;
+        }
+        value |= (byte & 0x7f) << (7 * i);
+        if (!(byte & 0x80)) {
+            return i + 1;
         }
     }
+    return 0;
+}
 
-    void dispatch(const RpcPacket<Payload>& packet) {
-        if (packet.callType == CallType::Call) {
-            if (packet.functionId < callHandlers.size()) {
-                auto& selfAndHandler = callHandlers[packet.functionId];
-                selfAndHandler.second(selfAndHandler.first, packet);
+/// writes up to `maxVarintHeaderSize` bytes, returns how many
+template<typename Payload>
+std::size_t writeVarintHeader(const RpcPacket<Payload>& packet, std::byte* out) {
+    assert(packet.functionId <= maxFunctionId);
+    std::size_t size = writeVarint(packet.instanceId, out);
+    size += writeVarint(uint32_t(packet.functionId) << 2 | uint32_t(packet.callType), out + size);
+    size += writeVarint(packet.callId, out + size);
+    return size;
+}
+
+/// returns the number of bytes read, 0 if the header is incomplete or not valid
+template<typename Payload>
+std::size_t readVarintHeader(std::span<const std::byte> in, RpcPacket<Payload>& packet) {
+    uint32_t instanceId, function, callId;
+    std::size_t size = readVarint(in, instanceId, 16);
+    std::size_t read = size ? readVarint(in.subspan(size), function, functionIdBits + 2) : 0;
+    size = read ? size + read : 0;
+    read = size ? readVarint(in.subspan(size), callId, 32) : 0;
+    if (!read || (function & 3) >= callTypeCount) {
+        return 0;
+    }
+    packet.instanceId = InstanceId(instanceId);
+    packet.functionId = FunctionId(function >> 2);
+    packet.callType = CallType(function & 3);
+    packet.callId = callId;
+    return size + read;
+}
+
+} // namespace wire
+
+/// Per-thread free list of packets. Packets are recycled with their payload buffers,
+/// so in a steady state sending and receiving do not allocate.
+/// Packets released on one thread are reused by the same thread only
+template<typename Payload, std::size_t Capacity>
+class PacketPool {
+public:
+    static RpcPacket<Payload> acquire() {
+        auto& packets = freePackets();
+        if (packets.empty()) {
+            return {};
+        }
+        auto packet = std::move(packets.back());
+        packets.pop_back();
+        return packet;
+    }
+
+    /// packets over capacity are just destroyed
+    static void release(RpcPacket<Payload>&& packet) {
+        auto& packets = freePackets();
+        if (packets.size() < Capacity) {
+            // reset header fields, keep payload memory
+            RpcPacket<Payload> recycled;
+            recycled.payload = std::move(packet.payload);
+            recycled.payload.clear();
+            packets.push_back(std::move(recycled));
+        }
+    }
+
+private:
+    static std::vector<RpcPacket<Payload>>& freePackets() {
+        thread_local std::vector<RpcPacket<Payload>> packets = [] {
+            std::vector<RpcPacket<Payload>> reserved;
+            reserved.reserve(Capacity);
+            return reserved;
+        }();
+        return packets;
+    }
+};
+
+template <class Interface, typename Payload, typename Config, typename Signature> struct RpcCall;
+
+/// Rpc kind that packs up to `MaxCalls` invocations into a single packet.
+/// Only Rpcs without result can be coalesced:
+///
+/// ```
+/// Rpc<rpc::Coalesced<void(int sensor, double value)>> telemetry = this;
+/// ```
+/// Calls are sent when `MaxCalls` are buffered, when the delay set by `setMaxDelay` is exceeded
+/// or on explicit `flush()`. `RpcInterface::flush()` flushes all coalesced Rpcs of an instance
+template<typename Signature, std::size_t MaxCalls = 64>
+struct Coalesced {};
+
+/// Rpc kind answered asynchronously. Its handler gets an `rpc::Responder<R>` before the arguments
+/// and returns immediately, Response is sent with the original call id when the responder is called,
+/// e.g. from a worker thread or a coroutine. Callers see a regular `R(Args...)` Rpc:
+///
+/// ```
+/// Rpc<rpc::Deferred<int(int v)>> slowSquare = this;
+///
+/// receiver.slowSquare = [&](rpc::Responder<int> responder, int v) {
+///     workers.post([responder = std::move(responder), v]() mutable { responder(v * v); });
+/// };
+/// ```
+/// `sendRpcPacket` should be thread-safe if responders are called from other threads
+template<typename Signature>
+struct Deferred {};
+
+/// Rpc kind returning a stream of `T` chunks. Its handler gets an `rpc::StreamWriter<T>` before the
+/// arguments, every chunk goes as its own Response with the call id, the last one marks the end.
+/// Calling it returns the call id, caller interface gets chunks through customization points:
+///
+/// ```
+/// Rpc<rpc::Stream<Account(int region)>> accounts = this;
+///
+/// template<typename T> void onStreamChunk(rpc::CallId callId, const T& chunk);
+/// template<typename T> void onStreamEnd(rpc::CallId callId);
+/// ```
+/// Flow control is credit-based: the writer may send only as many chunks as the caller has granted.
+/// The caller grants a window of chunks on call and more as `onStreamChunk` returns, so neither side
+/// buffers more than a window. With `setAutoGrant(false)` the caller grants credits with `grant`.
+/// Payload should support `std::optional` and `std::tuple`
+template<typename Signature>
+struct Stream {};
+
+/// chunks a stream caller grants on call, unless changed by `setWindow`
+inline constexpr uint32_t defaultStreamWindow = 16;
+
+/// Rpc kind whose handler gets `const rpc::LazyArgs<Payload, Args...>&` instead of arguments.
+/// Callers see a regular `R(Args...)` Rpc:
+///
+/// ```
+/// Rpc<rpc::Lazy<void(uint32_t shard, std::string document)>> store = this;
+///
+/// receiver.store = [&](const auto& args) {
+///     if (args.template get<0>() != myShard) {
+///         forward(args.packet()); // payload is passed on as is
+///     } else { /*...*/ }
+/// };
+/// ```
+template<typename Signature>
+struct Lazy {};
+
+/// String usable as a template argument, e.g. an Rpc name
+template<std::size_t N>
+struct FixedString {
+    constexpr FixedString(const char (&string)[N]) { std::copy_n(string, N, value); }
+    constexpr std::string_view view() const { return {value, N - 1}; }
+
+    char value[N];
+};
+
+/// FunctionId of a named Rpc: 32-bit FNV-1a of its name, arity and whether it has a result,
+/// folded to `wire::functionIdBits`. The same on every build and platform
+constexpr FunctionId namedFunctionId(std::string_view name, std::size_t arity, bool hasResult) {
+    uint32_t hash = 2166136261u;
+    auto add = [&hash](uint8_t byte) { hash = (hash ^ byte) * 16777619u; };
+    for (const char c : name) {
+        add(uint8_t(c));
+    }
+    add(uint8_t(arity));
+    add(uint8_t(hasResult));
+    return FunctionId((hash ^ (hash >> wire::functionIdBits)) & wire::maxFunctionId);
+}
+
+/// Rpc with a FunctionId derived from its name instead of its declaration order, so builds
+/// with reordered, added or removed Rpcs still agree on ids. `Signature` may be any Rpc kind:
+///
+/// ```
+/// Rpc<rpc::Named<"square", int(int v)>> square = this;
+/// Rpc<rpc::Named<"telemetry", rpc::Coalesced<void(int sensor, double value)>>> telemetry = this;
+/// ```
+/// Named Rpcs need `Interface::RpcMembers`, either all of its members are named or none. Ids are
+/// checked for collisions at compile time, and dispatch goes through a perfect hash table.
+/// Changing argument types keeps the id, such changes should come with a new name
+template<FixedString Name, typename Signature>
+struct Named {};
+
+template<typename Payload, typename Tuple>
+concept DecodesSingleArgument = std::tuple_size_v<Tuple> != 0
+    && requires(const Payload& payload) { payload.template deserializeArgument<Tuple, 0>(); };
+
+/// Arguments of a `Lazy` call, each one is decoded on its first access. Payloads may provide
+///
+/// ```
+/// template<typename Tuple, std::size_t I>
+/// std::tuple_element_t<I, Tuple> deserializeArgument() const
+/// ```
+/// to decode a single argument, otherwise all of them are decoded at the first access.
+/// Valid only during the handler call
+template<typename Payload, typename ...Args>
+class LazyArgs {
+public:
+    using Tuple = ArgsTuple<Args...>;
+
+    explicit LazyArgs(const RpcPacket<Payload>& packet) : call(packet) {}
+
+    LazyArgs(const LazyArgs&) = delete;
+    LazyArgs& operator = (const LazyArgs&) = delete;
+
+    template<std::size_t I>
+    const std::tuple_element_t<I, Tuple>& get() const {
+        if constexpr (decodesSingleArgument) {
+            auto& argument = std::get<I>(arguments);
+            if (!argument) {
+                argument.emplace(call.payload.template deserializeArgument<Tuple, I>());
             }
+            return *argument;
         } else {
-            auto handlerIt = resultHandlers.find(packet.functionId);
-            if (handlerIt != resultHandlers.end()) {
-                handlerIt->second(static_cast<Interface*>(this), packet);
+            if (!arguments) {
+                arguments.emplace(call.payload.template deserialize<Tuple>());
             }
+            return std::get<I>(*arguments);
         }
     }
 
-    void setInstanceId(InstanceId id) { instanceId = id; }
-    InstanceId getInstanceId() { return instanceId; }
-    CallId getNextCallId() { return ++callIdCounter; }
+    /// the packet being handled, e.g. to forward it without decoding
+    const RpcPacket<Payload>& packet() const { return call; }
 
-protected:
-    CallId callIdCounter = 0;
-    InstanceId instanceId = 0;
+private:
+    static constexpr bool decodesSingleArgument = DecodesSingleArgument<Payload, Tuple>;
 
-    std::vector<std::pair<void*, void(*)(void*, const RpcPacket<Payload>&)>> callHandlers;
-    std::unordered_map<FunctionId, void(*)(Interface*, const RpcPacket<Payload>&)> resultHandlers;
+    using Arguments = std::conditional_t<decodesSingleArgument,
+        std::tuple<std::optional<std::remove_cv_t<std::remove_reference_t<Args>>>...>,
+        std::optional<Tuple>>;
+
+    const RpcPacket<Payload>& call;
+    mutable Arguments arguments;
 };
 
+/// Sends the Response of a single `Deferred` call, at most once. Dropping it sends nothing.
+/// Should not outlive the interface that created it
+template<typename R>
+class Responder {
+public:
+    Responder() = default;
 
-template <class Interface, typename Payload, typename ReturnType, typename ...Args>
-struct RpcCall<Interface, Payload, ReturnType(Args...)> {
+    Responder(Responder&& other) noexcept
+        : call(other.call), send(std::exchange(other.send, nullptr)), callId(other.callId) {}
 
-    RpcCall(RpcInterface<Interface, Payload>* interface) {
-        interface->registerCall(*this);
+    Responder& operator = (Responder&& other) noexcept {
+        call = other.call;
+        send = std::exchange(other.send, nullptr);
+        callId = other.callId;
+        return *this;
     }
 
-    template<typename Functor>
-    void operator = (Functor&& f) {
-        remoteCallback = std::forward<Functor>(f);
+    /// true until the response is sent
+    explicit operator bool() const { return send != nullptr; }
+
+    CallId getCallId() const { return callId; }
+
+    template<typename Result>
+    void operator() (Result&& result) {
+        assert(send && "Response is already sent");
+        std::exchange(send, nullptr)(call, callId, R(std::forward<Result>(result)));
+    }
+
+private:
+    template <class, typename, typename, typename> friend struct RpcCall;
+
+    using Send = void(*)(void* call, CallId callId, R&& result);
+    Responder(void* call, Send send, CallId callId) : call(call), send(send), callId(callId) {}
+
+    void* call = nullptr;
+    Send send = nullptr;
+    CallId callId = 0;
+};
+
+/// Writes chunks of a single `Stream` call. Dropping or closing it ends the stream.
+/// Should not outlive the interface that created it, may be used from any thread
+template<typename T>
+class StreamWriter {
+public:
+    using Resume = InplaceFunction<void(StreamWriter), 4 * sizeof(void*)>;
+
+    StreamWriter() = default;
+
+    StreamWriter(StreamWriter&& other) noexcept
+        : call(std::exchange(other.call, nullptr)), operations(other.operations), callId(other.callId) {}
+
+    StreamWriter& operator = (StreamWriter&& other) noexcept {
+        if (this != &other) {
+            close();
+            call = std::exchange(other.call, nullptr);
+            operations = other.operations;
+            callId = other.callId;
+        }
+        return *this;
     }
 
-    inline decltype(auto) operator() (Args ...args) {
-        return doRemoteCall<CallType::Call>(interface->getNextCallId(), std::forward<Args>(args)...); // move copied args if any
+    ~StreamWriter() { close(); }
+
+    /// true until the stream is closed
+    explicit operator bool() const { return call != nullptr; }
+
+    CallId getCallId() const { return callId; }
+
+    /// chunks that can be written right now
+    uint32_t credits() const { return call ? operations->credits(call, callId) : 0; }
+
+    /// sends a chunk if there are credits, returns false otherwise
+    template<typename Chunk>
+    bool write(Chunk&& chunk) {
+        assert(call && "Stream is closed");
+        return operations->write(call, callId, T(std::forward<Chunk>(chunk)));
     }
 
-protected:
-    friend class RpcInterface<Interface, Payload>;
+    /// sends the end of the stream
+    void close() {
+        if (call) {
+            operations->close(std::exchange(call, nullptr), callId);
+        }
+    }
 
-    template<CallType callType, typename ...Arguments>
-    inline decltype(auto) doRemoteCall(uint32_t callId, Arguments&& ...args) {
-        RpcPacket<Payload> packet;
-        packet.instanceId = interface->getInstanceId();
-        packet.functionId = functionId;
-        packet.callId = callId;
-        packet.callType = callType;
-        packet.payload.serialize(std::forward<Arguments>(args)...);
+    /// Gives the writer back to `resume(StreamWriter<T>)` once there are credits, right away if there
+    /// are some already. Otherwise it is called from `dispatch` of the packet granting them
+    template<typename F>
+    void onCredits(F&& resume) && {
+        assert(call && "Stream is closed");
+        operations->suspend(std::exchange(call, nullptr), callId, Resume(std::forward<F>(resume)));
+    }
+
+private:
+    template <class, typename, typename, typename> friend struct RpcCall;
+
+    struct Operations {
+        bool(*write)(void* call, CallId callId, T&& chunk);
+        void(*close)(void* call, CallId callId);
+        uint32_t(*credits)(void* call, CallId callId);
+        void(*suspend)(void* call, CallId callId, Resume&& resume);
+    };
+
+    StreamWriter(void* call, const Operations* operations, CallId callId) : call(call), operations(operations), callId(callId) {}
+
+    void* call = nullptr;
+    const Operations* operations = nullptr;
+    CallId callId = 0;
+};
+
+/// Node of an intrusive per-instance list of Rpcs buffering outgoing calls
+struct BufferedCall {
+    void(*flushCalls)(BufferedCall*) = nullptr;
+    // flushes calls if the oldest one is due at `now`, returns true if it did
+    bool(*flushCallsIfDue)(BufferedCall*, std::chrono::steady_clock::time_point now) = nullptr;
+    BufferedCall* nextBufferedCall = nullptr;
+};
+
+/// Compile-time list of interface Rpc members.
+/// Members should be listed in the same order they are declared in:
+///
+/// ```
+/// struct MyInterface : public rpc::RpcInterface<MyInterface, Payload> {
+///     Rpc<void()> notify = this;
+///     Rpc<int(int v)> square = this;
+///
+///     using RpcMembers = rpc::RpcList<&MyInterface::notify, &MyInterface::square>;
+/// };
+/// ```
+/// When `Interface::RpcMembers` is defined, FunctionIds are known at compile time and `dispatch`
+/// goes through a single static table instead of per-instance handler containers
+template<auto... Members>
+struct RpcList {};
 
-        return static_cast<Interface*>(interface)->template sendRpcPacket<ReturnType>(std::move(packet));
+/// Type-erased Rpc packet handler, `target` is an object it should be invoked with
+template<typename Payload>
+struct PacketHandler {
+    void(*handler)(void* target, const RpcPacket<Payload>&) = nullptr;
+    void* target = nullptr;
+
+    explicit operator bool() const { return handler != nullptr; }
+    void operator() (const RpcPacket<Payload>& packet) const { handler(target, packet); }
+};
+
+/// Handlers for a single FunctionId invoked with an `Interface*`. `onResult` is null for Rpcs without result
+template<typename Payload>
+struct RpcHandlers {
+    void(*onCall)(void* interface, const RpcPacket<Payload>&) = nullptr;
+    void(*onResult)(void* interface, const RpcPacket<Payload>&) = nullptr;
+};
+
+/// Same for interfaces without any Rpc with result, they have no result handlers to store
+template<typename Payload>
+struct OneWayRpcHandlers {
+    void(*onCall)(void* interface, const RpcPacket<Payload>&) = nullptr;
+};
+
+template<class Interface, typename = void>
+struct HasRpcList : std::false_type {};
+
+template<class Interface>
+struct HasRpcList<Interface, std::void_t<typename Interface::RpcMembers>> : std::true_type {};
+
+template<class Interface, typename Payload, typename List> struct StaticDispatchTable;
+
+template<typename Call>
+concept NamedRpc = requires { { Call::namedId } -> std::convertible_to<FunctionId>; };
+
+template<class Interface, typename Payload, auto... Members>
+struct StaticDispatchTable<Interface, Payload, RpcList<Members...>> {
+    static_assert(sizeof...(Members) > 0, "RpcList should not be empty");
+
+    template<auto Member>
+    using MemberCall = std::remove_reference_t<decltype(std::declval<Interface&>().*Member)>;
+
+    static constexpr FunctionId size = static_cast<FunctionId>(sizeof...(Members));
+    static constexpr bool named = (NamedRpc<MemberCall<Members>> || ...);
+    static_assert(!named || (NamedRpc<MemberCall<Members>> && ...), "Either all or none of RpcMembers should be named");
+    static constexpr bool hasResults = (MemberCall<Members>::hasResult || ...);
+
+    using Handlers = std::conditional_t<hasResults, RpcHandlers<Payload>, OneWayRpcHandlers<Payload>>;
+
+    template<auto Member>
+    static void onCall(void* self, const RpcPacket<Payload>& packet) {
+        (static_cast<Interface*>(self)->*Member).handleCall(packet);
     }
 
-    auto makeCallHandler() {
-        return [](void* selfPtr, const RpcPacket<Payload>& packet) {
-            auto* self = static_cast<RpcCall<Interface, Payload, ReturnType(Args...)>*>(selfPtr);
+    template<auto Member>
+    static void onResult(void* self, const RpcPacket<Payload>& packet) {
+        (static_cast<Interface*>(self)->*Member).handleResult(packet);
+    }
 
-            using Tuple = ArgsTuple<Args...>;
-            if constexpr (std::is_same_v<void, ReturnType>) {
-                std::apply(self->remoteCallback, packet.payload.template deserialize<Tuple>());
-            } else {
-                auto result = std::apply(self->remoteCallback, packet.payload.template deserialize<Tuple>());
-                self->template doRemoteCall<CallType::Response>(packet.callId, std::move(result));
-            }
-        };
+    template<auto Member>
+    static constexpr Handlers makeHandlers() {
+        if constexpr (MemberCall<Member>::hasResult) {
+            return {&onCall<Member>, &onResult<Member>};
+        } else {
+            return {&onCall<Member>};
+        }
     }
 
-    auto makeResultHandler() {
-        return [](Interface* interface, const RpcPacket<Payload>& packet) {
-            const auto& result = packet.payload.template deserialize<std::tuple<ReturnType>>();
-            interface->template onResultReturned<ReturnType>(packet.callId, std::get<0>(result));
-        };
+    /// handler of `callType` packets, null if there is none. Cancel packets go to the call handler
+    static auto handlerOf(const Handlers& handlers, CallType callType) {
+        if constexpr (hasResults) {
+            return callType == CallType::Response ? handlers.onResult : handlers.onCall;
+        } else {
+            return callType == CallType::Response ? nullptr : handlers.onCall;
+        }
     }
 
-    std::function<ReturnType(Args...)> remoteCallback;
-    RpcInterface<Interface, Payload>* interface;
-    FunctionId functionId = 0;
+    /// checks that `call` is the member listed at `index`, used to validate declaration order
+    template<std::size_t... I>
+    static bool isListedAt(Interface* self, FunctionId index, const void* call, std::index_sequence<I...>) {
+        return ((index == I && static_cast<const void*>(&(self->*Members)) == call) || ...);
+    }
+
+    static bool isListedAt(Interface* self, FunctionId index, const void* call) {
+        return isListedAt(self, index, call, std::make_index_sequence<sizeof...(Members)>{});
+    }
+
+    template<auto Member>
+    static constexpr FunctionId functionIdOf(FunctionId index) {
+        if constexpr (NamedRpc<MemberCall<Member>>) {
+            return MemberCall<Member>::namedId;
+        } else {
+            return index;
+        }
+    }
+
+    /// handlers of Rpc with `functionId`, null if there is none
+    static const Handlers* find(FunctionId functionId) {
+        if constexpr (named) {
+            const auto& slot = hashSlots[hashSlot(functionId, hashing)];
+            return slot.functionId == functionId && slot.handlers.onCall ? &slot.handlers : nullptr;
+        } else {
+            return functionId < size ? &entries[functionId] : nullptr;
+        }
+    }
+
+    /// FunctionId of the member listed at `index`
+    static constexpr FunctionId functionIdAt(FunctionId index) {
+        return index < size ? functionIds[index] : index;
+    }
+
+    alignas(64) static constexpr Handlers entries[] = {makeHandlers<Members>()...};
+
+private:
+    static constexpr auto makeFunctionIds() {
+        FunctionId index = 0;
+        return std::array<FunctionId, size>{functionIdOf<Members>(index++)...};
+    }
+
+    static constexpr std::array<FunctionId, size> functionIds = makeFunctionIds();
+
+    static constexpr bool idsAreUnique() {
+        auto ids = functionIds;
+        std::sort(ids.begin(), ids.end());
+        return std::adjacent_find(ids.begin(), ids.end()) == ids.end();
+    }
+
+    static_assert(idsAreUnique(), "FunctionIds of named Rpcs collide, rename one of them");
+
+    // perfect hash of named ids: `bits` top bits of `id * multiplier`, or plain low bits if nothing else fits
+    struct Hashing {
+        unsigned bits = wire::functionIdBits;
+        uint32_t multiplier = 0;
+    };
+
+    static constexpr std::size_t hashSlot(FunctionId functionId, Hashing hashing) {
+        if (hashing.multiplier == 0) {
+            return functionId & ((1u << hashing.bits) - 1);
+        }
+        return uint32_t(functionId * hashing.multiplier) >> (32 - hashing.bits);
+    }
+
+    static constexpr bool isPerfect(Hashing hashing) {
+        for (std::size_t i = 0; i < size; ++i) {
+            for (std::size_t j = i + 1; j < size; ++j) {
+                if (hashSlot(functionIds[i], hashing) == hashSlot(functionIds[j], hashing)) {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+
+    static constexpr Hashing findHashing() {
+        if constexpr (named) {
+            // tables are at most 4 times bigger than needed
+            for (unsigned bits = unsigned(std::bit_width(std::size_t(size))); bits <= std::bit_width(std::size_t(size)) + 1u
+                 && bits < wire::functionIdBits; ++bits) {
+                for (uint32_t attempt = 0; attempt < 256; ++attempt) {
+                    const Hashing hashing{bits, 0x9e3779b1u + 2 * attempt};
+                    if (isPerfect(hashing)) {
+                        return hashing;
+                    }
+                }
+            }
+        }
+        return {};
+    }
+
+    struct HashSlot {
+        FunctionId functionId = 0;
+        Handlers handlers;
+    };
+
+    static constexpr Hashing hashing = findHashing();
+
+    static constexpr auto makeHashSlots() {
+        std::array<HashSlot, named ? (std::size_t(1) << hashing.bits) : 1> slots = {};
+        if constexpr (named) {
+            for (FunctionId i = 0; i < size; ++i) {
+                slots[hashSlot(functionIds[i], hashing)] = {functionIds[i], entries[i]};
+            }
+        }
+        return slots;
+    }
+
+    alignas(64) static constexpr auto hashSlots = makeHashSlots();
+};
+
+/// should be used only when `Interface` is complete
+template<class Interface, typename Payload>
+using StaticDispatchTableOf = StaticDispatchTable<Interface, Payload, typename Interface::RpcMembers>;
+
+/// Handlers of an Rpc member found at `offset` from its `RpcInterface`.
+/// `onResult` is null for Rpcs without result
+template<typename Payload>
+struct RpcMemberHandlers {
+    std::ptrdiff_t offset = 0;
+    void(*onCall)(void* call, const RpcPacket<Payload>&) = nullptr;
+    void(*onResult)(void* call, const RpcPacket<Payload>&) = nullptr;
+
+    bool operator == (const RpcMemberHandlers& other) const {
+        return offset == other.offset && onCall == other.onCall && onResult == other.onResult;
+    }
+};
+
+/// Handler table shared by all instances of a type declaring Rpcs. It is filled by the first
+/// constructed instance, later instances only check that their members match the table.
+/// Entries are stored in pages and never move, so lookups and checks need no lock
+template<typename Payload>
+class SharedHandlerTable {
+public:
+    using Entry = RpcMemberHandlers<Payload>;
+    static constexpr std::size_t pageSize = 64;
+
+    SharedHandlerTable() = default;
+    SharedHandlerTable(const SharedHandlerTable&) = delete;
+    SharedHandlerTable& operator = (const SharedHandlerTable&) = delete;
+
+    ~SharedHandlerTable() {
+        for (auto* page : pages) {
+            delete[] page;
+        }
+    }
+
+    /// adds entry `index`, or checks that it is the same as the one already added
+    void add(FunctionId index, const Entry& entry) {
+        if (index >= size.load(std::memory_order_acquire)) {
+            // only instances constructed concurrently with the first one may get here
+            std::lock_guard<std::mutex> lock(mutex);
+            const auto filled = size.load(std::memory_order_relaxed);
+            assert(index <= filled && "Rpcs are registered in declaration order");
+            if (index == filled) {
+                auto*& page = pages[index / pageSize];
+                if (!page) {
+                    page = new Entry[pageSize];
+                }
+                page[index % pageSize] = entry;
+                size.store(index + 1, std::memory_order_release);
+                return;
+            }
+        }
+        assert(at(index) == entry && "All instances of an Interface type should have the same Rpc members");
+    }
+
+    /// `index` should be added before, by this thread or one that has published the instance to it
+    const Entry& at(FunctionId index) const { return pages[index / pageSize][index % pageSize]; }
+
+private:
+    std::atomic<std::size_t> size{0};
+    std::mutex mutex;
+    Entry* pages[(std::size_t(wire::maxFunctionId) + pageSize) / pageSize] = {};
+};
+
+template<class Interface, typename Payload, typename Config = DefaultConfig>
+class RpcInterface {
+public:
+
+    template<typename Signature>
+    using Rpc = RpcCall<Interface, Payload, Config, Signature>;
+
+    /// `Owner` is the type declaring `call`, handlers are shared by its instances
+    template<class Owner = Interface, typename Signature>
+    void registerCall(RpcCall<Interface, Payload, Config, Signature>& call) {
+        assert(registeredCalls <= wire::maxFunctionId && "Too many Rpcs for the wire header");
+        const FunctionId index = registeredCalls++;
+        call.interface = this;
+
+        if constexpr (HasRpcList<Interface>::value) {
+            // handlers are already known from `Interface::RpcMembers`, nothing to store per instance
+            using Table = StaticDispatchTableOf<Interface, Payload>;
+            assert(Table::isListedAt(static_cast<Interface*>(this), index, &call)
+                   && "RpcMembers should list all Rpc members in declaration order");
+            call.functionId = Table::functionIdAt(index);
+        } else {
+            call.functionId = index;
+            using Call = RpcCall<Interface, Payload, Config, Signature>;
+            RpcMemberHandlers<Payload> entry;
+            entry.offset = reinterpret_cast<const char*>(&call) - reinterpret_cast<const char*>(this);
+            entry.onCall = &Call::onCall;
+            if constexpr (Call::hasResult) {
+                entry.onResult = &Call::onResult;
+            }
+
+            // Interface may be a base of types declaring Rpcs, a table of every such type keeps
+            // all Rpcs of its instances, the ones declared by bases are copied from their tables
+            auto& table = sharedHandlerTable<Owner>();
+            if (handlerTable != &table) {
+                for (FunctionId i = 0; i < index; ++i) {
+                    table.add(i, handlerTable->at(i));
+                }
+                handlerTable = &table;
+            }
+            table.add(index, entry);
+        }
+        stats.addFunction(call.functionId);
+    }
+
+    void registerBufferedCall(BufferedCall& call) {
+        call.nextBufferedCall = bufferedCalls;
+        bufferedCalls = &call;
+    }
+
+    /// sends all calls buffered by coalesced Rpcs
+    void flush() {
+        for (auto* call = bufferedCalls; call; call = call->nextBufferedCall) {
+            call->flushCalls(call);
+        }
+    }
+
+    /// Sends calls of coalesced Rpcs whose oldest call waits longer than their `setMaxDelay`,
+    /// returns true if any were sent. Calls are checked on push too, but only this bounds the delay
+    /// of calls followed by silence, so it should be called by a timer or an event loop
+    bool flushIfDue(std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now()) {
+        bool flushed = false;
+        for (auto* call = bufferedCalls; call; call = call->nextBufferedCall) {
+            flushed |= call->flushCallsIfDue(call, now);
+        }
+        return flushed;
+    }
+
+    void dispatch(const RpcPacket<Payload>& packet) {
+        if (auto handler = findHandler(packet.callType, packet.functionId)) {
+            handler(packet);
+        }
+    }
+
+    /// Dispatches a burst of packets. Packets are grouped by call type and FunctionId and each
+    /// handler is resolved once per group. Packets of the same group keep their relative order,
+    /// but groups are not handled in the order they were received.
+    /// Exceptions thrown by handlers are propagated and the rest of the batch is not dispatched
+    void dispatchBatch(std::span<const RpcPacket<Payload>> packets) {
+        dispatchGrouped(packets, [](const PacketHandler<Payload>& handler, const RpcPacket<Payload>& packet, std::size_t) {
+            if (handler) {
+                handler(packet);
+            }
+        });
+    }
+
+    /// Same as above, but every packet is dispatched and its result is stored in `statuses`
+    /// at the packet index instead of throwing. `statuses` should be at least as long as `packets`
+    void dispatchBatch(std::span<const RpcPacket<Payload>> packets, std::span<DispatchStatus> statuses) {
+        assert(statuses.size() >= packets.size());
+        dispatchGrouped(packets, [statuses](const PacketHandler<Payload>& handler, const RpcPacket<Payload>& packet, std::size_t index) {
+            if (!handler) {
+                statuses[index] = DispatchStatus::UnknownFunction;
+                return;
+            }
+            try {
+                handler(packet);
+                statuses[index] = DispatchStatus::Ok;
+            } catch (...) {
+                statuses[index] = DispatchStatus::HandlerFailed;
+            }
+        });
+    }
+
+    /// returns an empty handler if there is no such Rpc
+    PacketHandler<Payload> findHandler(CallType callType, FunctionId functionId) {
+        if constexpr (HasRpcList<Interface>::value) {
+            using Table = StaticDispatchTableOf<Interface, Payload>;
+            if (const auto* handlers = Table::find(functionId)) {
+                return {Table::handlerOf(*handlers, callType), static_cast<Interface*>(this)};
+            }
+        } else if (functionId < registeredCalls) {
+            // entries of this instance are not modified anymore as it is fully constructed
+            const auto& entry = handlerTable->at(functionId);
+            return {callType == CallType::Response ? entry.onResult : entry.onCall, reinterpret_cast<char*>(this) + entry.offset};
+        }
+        return {};
+    }
+
+    /// Packets used for outgoing calls. With `Config::packetPoolSize` set, transport should
+    /// return sent packets with `releasePacket`, and so should receiver after dispatching them
+    static RpcPacket<Payload> acquirePacket() {
+        if constexpr (Config::packetPoolSize != 0) {
+            return PacketPool<Payload, Config::packetPoolSize>::acquire();
+        } else {
+            return {};
+        }
+    }
+
+    static void releasePacket(RpcPacket<Payload>&& packet) {
+        if constexpr (Config::packetPoolSize != 0) {
+            PacketPool<Payload, Config::packetPoolSize>::release(std::move(packet));
+        }
+    }
+
+    using Stats = typename Config::Stats;
+
+    /// statistics of this instance, see `Config::Stats`
+    Stats& getStats() { return stats; }
+    const Stats& getStats() const { return stats; }
+
+    void setInstanceId(InstanceId id) { instanceId = id; }
+    InstanceId getInstanceId() { return instanceId; }
+    CallId getNextCallId() {
+        if constexpr (!Config::concurrentCalls) {
+            return ++callIdCounter;
+        } else if constexpr (Config::callIdBlockSize <= 1) {
+            return callIdCounter.fetch_add(1, std::memory_order_relaxed) + 1;
+        } else {
+            // ranges of instances of this type used by this thread, by instance serial, which is never
+            // reused unlike addresses, so a thread switching between instances doesn't drop their ranges
+            struct Range {
+                uint64_t ownerSerial = 0;
+                CallId next = 0;
+                CallId end = 0;
+            };
+            static_assert(Config::callIdBlockCacheSize > 0);
+            thread_local std::array<Range, Config::callIdBlockCacheSize> ranges;
+            auto& range = ranges[instanceSerial % ranges.size()];
+            if (range.ownerSerial != instanceSerial || range.next == range.end) {
+                range.ownerSerial = instanceSerial;
+                range.next = callIdCounter.fetch_add(Config::callIdBlockSize, std::memory_order_relaxed) + 1;
+                range.end = range.next + Config::callIdBlockSize;
+            }
+            return range.next++;
+        }
+    }
+
+protected:
+    struct NoSerial {};
+    static constexpr bool usesCallIdBlocks = Config::concurrentCalls && Config::callIdBlockSize > 1;
+
+    static auto makeInstanceSerial() {
+        if constexpr (usesCallIdBlocks) {
+            static std::atomic<uint64_t> serials{0};
+            return serials.fetch_add(1, std::memory_order_relaxed) + 1;
+        } else {
+            return NoSerial{};
+        }
+    }
+
+    std::conditional_t<Config::concurrentCalls, std::atomic<CallId>, CallId> callIdCounter{0};
+    [[no_unique_address]] std::conditional_t<usesCallIdBlocks, uint64_t, NoSerial> instanceSerial = makeInstanceSerial();
+    InstanceId instanceId = 0;
+    FunctionId registeredCalls = 0;
+    [[no_unique_address]] Stats stats;
+
+    template<class Owner>
+    static SharedHandlerTable<Payload>& sharedHandlerTable() {
+        static SharedHandlerTable<Payload> table;
+        return table;
+    }
+
+    const void* handlerEntry(FunctionId functionId) {
+        if constexpr (HasRpcList<Interface>::value) {
+            return StaticDispatchTableOf<Interface, Payload>::find(functionId);
+        } else {
+            return functionId < registeredCalls ? &handlerTable->at(functionId) : nullptr;
+        }
+    }
+
+    static uint32_t groupOf(const RpcPacket<Payload>& packet) {
+        return uint32_t(packet.callType) << 16 | packet.functionId;
+    }
+
+    // scratch buffer for `dispatchBatch`, per thread as batches of an interface may be dispatched concurrently
+    static std::vector<uint64_t>& batchOrder() {
+        thread_local std::vector<uint64_t> order;
+        return order;
+    }
+
+    template<typename Visitor>
+    void dispatchGrouped(std::span<const RpcPacket<Payload>> packets, Visitor&& visit) {
+        // bursts of a single Rpc or already grouped ones need no sorting
+        bool grouped = true;
+        for (std::size_t i = 1; grouped && i < packets.size(); ++i) {
+            grouped = groupOf(packets[i - 1]) <= groupOf(packets[i]);
+        }
+        if (grouped) {
+            dispatchRuns(packets, [packets](std::size_t i) { return groupOf(packets[i]); }, [](std::size_t i) { return i; }, visit);
+            return;
+        }
+
+        // buffer is taken out for the batch, so batches dispatched by handlers get their own,
+        // and is put back however the batch ends
+        struct Scratch {
+            std::vector<uint64_t> order;
+            ~Scratch() { batchOrder() = std::move(order); }
+        } scratch{std::move(batchOrder())};
+        auto& order = scratch.order;
+
+        // key is `callType | functionId | packet index`, so sorting groups packets and keeps their order in a group
+        order.clear();
+        order.reserve(packets.size());
+        for (std::size_t i = 0; i < packets.size(); ++i) {
+            order.push_back(uint64_t(groupOf(packets[i])) << 32 | uint32_t(i));
+        }
+        std::sort(order.begin(), order.end());
+        dispatchRuns(packets, [&order](std::size_t i) { return uint32_t(order[i] >> 32); },
+                     [&order](std::size_t i) { return std::size_t(uint32_t(order[i])); }, visit);
+    }
+
+    // visits packets in the order of `indexOf(0..)`, resolving a handler once per run of the same `groupAt`
+    template<typename GroupAt, typename IndexOf, typename Visitor>
+    void dispatchRuns(std::span<const RpcPacket<Payload>> packets, GroupAt&& groupAt, IndexOf&& indexOf, Visitor& visit) {
+        for (std::size_t begin = 0; begin < packets.size();) {
+            const uint32_t group = groupAt(begin);
+            std::size_t end = begin + 1;
+            while (end < packets.size() && groupAt(end) == group) {
+                ++end;
+            }
+            if (end < packets.size()) {
+                prefetch(handlerEntry(FunctionId(groupAt(end))));
+                prefetch(&packets[indexOf(end)]);
+            }
+
+            const auto& first = packets[indexOf(begin)];
+            const auto handler = findHandler(first.callType, first.functionId);
+            for (std::size_t i = begin; i < end; ++i) {
+                const std::size_t index = indexOf(i);
+                visit(handler, packets[index], index);
+            }
+            begin = end;
+        }
+    }
+
+    SharedHandlerTable<Payload>* handlerTable = nullptr; // of the most derived type declaring Rpcs
+    BufferedCall* bufferedCalls = nullptr;
+};
+
+
+/// Bounded cache of serialized results of an Rpc by its serialized arguments, see `RpcCall::enableResultCache`.
+/// Entries are found by argument hash and checked against the stored arguments, so collisions are misses.
+/// When full, CLOCK picks the entry to evict: the hand passes over entries hit since it last saw them.
+/// Thread-safe, hits copy the cached payload out under the lock
+template<typename Payload>
+class ResultCache {
+public:
+    explicit ResultCache(std::size_t capacity) : entries(std::max<std::size_t>(capacity, 1)) {
+        index.reserve(entries.size());
+    }
+
+    ResultCache(const ResultCache&) = delete;
+    ResultCache& operator = (const ResultCache&) = delete;
+
+    /// copies the result cached for `arguments` into `result`, returns false if there is none
+    bool find(std::span<const std::byte> arguments, Payload& result) {
+        const uint64_t key = hashOf(arguments);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (auto it = index.find(key); it != index.end()) {
+                auto& entry = entries[it->second];
+                if (std::ranges::equal(entry.arguments, arguments)) {
+                    entry.referenced = true;
+                    result = entry.result;
+                    hitCount.fetch_add(1, std::memory_order_relaxed);
+                    return true;
+                }
+            }
+        }
+        missCount.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    /// replaces the result of the same arguments or of a colliding hash, if any
+    void insert(std::span<const std::byte> arguments, const Payload& result) {
+        const uint64_t key = hashOf(arguments);
+        std::lock_guard<std::mutex> lock(mutex);
+        auto [it, inserted] = index.try_emplace(key, 0);
+        if (inserted) {
+            it->second = evict();
+        }
+        auto& entry = entries[it->second];
+        entry.key = key;
+        entry.arguments.assign(arguments.begin(), arguments.end());
+        entry.result = result;
+        entry.used = true;
+        entry.referenced = false; // entries that are never hit go first
+    }
+
+    void clear() {
+        std::lock_guard<std::mutex> lock(mutex);
+        index.clear();
+        for (auto& entry : entries) {
+            entry = Entry{};
+        }
+        hand = 0;
+    }
+
+    std::size_t capacity() const { return entries.size(); }
+    uint64_t hits() const { return hitCount.load(std::memory_order_relaxed); }
+    uint64_t misses() const { return missCount.load(std::memory_order_relaxed); }
+
+private:
+    struct Entry {
+        uint64_t key = 0;
+        std::vector<std::byte> arguments;
+        Payload result;
+        bool used = false;
+        bool referenced = false;
+    };
+
+    static uint64_t hashOf(std::span<const std::byte> bytes) {
+        return std::hash<std::string_view>{}(std::string_view(reinterpret_cast<const char*>(bytes.data()), bytes.size()));
+    }
+
+    // frees a slot for a new entry, its key is already in the index
+    uint32_t evict() {
+        while (true) {
+            const uint32_t slot = hand;
+            hand = (hand + 1) % uint32_t(entries.size());
+            auto& entry = entries[slot];
+            if (!entry.used) {
+                return slot;
+            }
+            if (!entry.referenced) {
+                index.erase(entry.key);
+                entry.used = false;
+                return slot;
+            }
+            entry.referenced = false;
+        }
+    }
+
+    std::vector<Entry> entries;
+    std::unordered_map<uint64_t, uint32_t> index;
+    uint32_t hand = 0;
+    std::mutex mutex;
+    std::atomic<uint64_t> hitCount{0};
+    std::atomic<uint64_t> missCount{0};
+};
+
+
+template <class Interface, typename Payload, typename Config, typename ReturnType, typename ...Args>
+struct RpcCall<Interface, Payload, Config, ReturnType(Args...)> {
+    using Callback = InplaceFunction<ReturnType(Args...), Config::callbackCapacity>;
+
+    /// `owner` is `this` of the type declaring the Rpc
+    template<class Owner> requires std::is_base_of_v<RpcInterface<Interface, Payload, Config>, Owner>
+    RpcCall(Owner* owner) {
+        owner->template registerCall<Owner>(*this);
+    }
+
+    template<typename Functor>
+    void operator = (Functor&& f) {
+        remoteCallback = Callback(std::forward<Functor>(f));
+    }
+
+    /// binds member function as a handler: `rpc.bind<&Handler::method>(&handler)`
+    template<auto Method, class Object>
+    void bind(Object* object) {
+        remoteCallback = Callback::template bind<Method>(object);
+    }
+
+    FunctionId getFunctionId() const { return functionId; }
+
+    /// Rvalues and braced initializers, e.g. `addPhonebook({{"John", 3355450}})`.
+    /// Reference arguments bind directly, by-value arguments are moved into payload
+    inline decltype(auto) operator() (Args&& ...args) {
+        return doRemoteCall<CallType::Call>(nextCallId(), std::forward<Args>(args)...);
+    }
+
+    /// Lvalues and arguments of other types. Arguments of declared types are serialized
+    /// right from caller objects, others are converted to declared types first
+    template<typename ...CallArgs> requires isCallableWith<void(Args...), CallArgs...>
+    inline decltype(auto) operator() (CallArgs&& ...args) {
+        return doRemoteCall<CallType::Call>(nextCallId(), forwardAs<Args>(std::forward<CallArgs>(args))...);
+    }
+
+    /// Asks the receiver to drop call `callId` if it has not handled it yet. Receivers report it to
+    /// `Interface::onCallCancelled(FunctionId, CallId)` if there is one, results may still come
+    void cancel(CallId callId) {
+        doRemoteCall<CallType::Cancel>(callId);
+    }
+
+    /// with `Config::deadlines`, calls get at most `timeout` to be handled, 0 is no limit
+    void setTimeout(std::chrono::nanoseconds timeout) {
+        static_assert(Config::deadlines, "Timeouts need `Config::deadlines`");
+        this->timeout = timeout;
+    }
+
+    /// Payloads of calls and results this side sends are compressed if they take at least `bytes`,
+    /// 0 turns it off. Needs a payload with `compress(threshold)`, e.g. `rpc::CompressedPayload`
+    void setCompressionThreshold(std::size_t bytes) {
+        static_assert(requires(Payload payload) { payload.compress(std::size_t()); }, "Payload does not support compression");
+        compressionThreshold = uint32_t(std::min<std::size_t>(bytes, ~uint32_t(0)));
+    }
+
+    /// Caches up to `entries` results of this Rpc by its argument bytes, 0 turns it off. Only for
+    /// handlers whose result depends on arguments alone. Set it before calls are dispatched.
+    /// Needs a copyable payload exposing `bytes()`
+    void enableResultCache(std::size_t entries) {
+        static_assert(hasResult, "Rpcs without result have nothing to cache");
+        static_assert(std::is_copy_assignable_v<Payload> && requires(const Payload payload) { payload.bytes(); },
+                      "Payload does not support result caching");
+        resultCache = entries != 0 ? std::make_unique<ResultCache<Payload>>(entries) : nullptr;
+    }
+
+    /// null if results are not cached
+    const ResultCache<Payload>* getResultCache() const { return resultCache.get(); }
+
+protected:
+    friend class RpcInterface<Interface, Payload, Config>;
+    template<class, typename, typename> friend struct StaticDispatchTable;
+
+    /// used by derived Rpc kinds to register themselves
+    struct DeferRegistration {};
+    RpcCall(RpcInterface<Interface, Payload, Config>* interface, DeferRegistration) : interface(interface) {}
+
+    template<CallType callType, bool withDeadline = callType == CallType::Call, typename ...Arguments>
+    inline decltype(auto) doRemoteCall(uint32_t callId, Arguments&& ...args) {
+        auto packet = makePacket<callType, withDeadline>(callId);
+        serializePayload(packet.payload, std::forward<Arguments>(args)...);
+        return sendPacket<callType>(std::move(packet));
+    }
+
+    /// packet with header filled and empty payload
+    template<CallType callType, bool withDeadline = callType == CallType::Call>
+    RpcPacket<Payload> makePacket(uint32_t callId) {
+        RpcPacket<Payload> packet = interface->acquirePacket();
+        packet.instanceId = interface->getInstanceId();
+        packet.functionId = functionId;
+        packet.callId = callId;
+        packet.callType = callType;
+        if constexpr (Config::deadlines && withDeadline) {
+            packet.deadline = timeout.count() != 0 ? earliest(currentDeadline(), std::chrono::steady_clock::now() + timeout)
+                                                   : currentDeadline();
+        } else {
+            packet.deadline = noDeadline;
+        }
+        return packet;
+    }
+
+    template<typename ...Arguments>
+    void serializePayload(Payload& payload, Arguments&& ...args) {
+        payload.serialize(std::forward<Arguments>(args)...);
+        if constexpr (requires { payload.compress(std::size_t()); }) {
+            if (compressionThreshold != 0) {
+                payload.compress(compressionThreshold);
+            }
+        }
+    }
+
+    /// Sends the result of `compute()` for call `packet`. With a result cache, results are looked up
+    /// by argument bytes first, hits are sent as they were cached, with neither `compute` nor decoding
+    template<typename Compute>
+    void respond(const RpcPacket<Payload>& packet, Compute&& compute) {
+        if constexpr (requires { packet.payload.bytes(); }) {
+            if (resultCache) {
+                auto response = makePacket<CallType::Response>(packet.callId);
+                if (!resultCache->find(packet.payload.bytes(), response.payload)) {
+                    serializePayload(response.payload, compute());
+                    resultCache->insert(packet.payload.bytes(), response.payload);
+                }
+                sendPacket<CallType::Response>(std::move(response));
+                return;
+            }
+        }
+        doRemoteCall<CallType::Response>(packet.callId, compute());
+    }
+
+    template<CallType callType>
+    inline decltype(auto) sendPacket(RpcPacket<Payload>&& packet) {
+        auto& stats = interface->getStats();
+        stats.onSent(functionId, callType, payloadSize(packet.payload));
+        // cancels expect nothing back, whatever the result type is
+        using Result = std::conditional_t<callType == CallType::Cancel, void, ReturnType>;
+        auto* sender = static_cast<Interface*>(interface);
+        if constexpr (callType == CallType::Call && hasResult && Config::Stats::enabled) {
+            // `sendRpcPacket` may give the call its own id, e.g. a `ResultSlots` slot, so the id
+            // is read back from the packet it was given once it returns
+            const CallId callId = packet.callId;
+            stats.onCallStarted(functionId, callId);
+            using Sent = decltype(sender->template sendRpcPacket<Result>(std::move(packet)));
+            if constexpr (std::is_void_v<Sent>) {
+                sender->template sendRpcPacket<Result>(std::move(packet));
+                if (packet.callId != callId) {
+                    stats.onCallIdChanged(functionId, callId, packet.callId);
+                }
+            } else {
+                Sent sent = sender->template sendRpcPacket<Result>(std::move(packet));
+                if (packet.callId != callId) {
+                    stats.onCallIdChanged(functionId, callId, packet.callId);
+                }
+                return sent;
+            }
+        } else {
+            return sender->template sendRpcPacket<Result>(std::move(packet));
+        }
+    }
+
+    static constexpr bool hasResult = !std::is_same_v<void, ReturnType>;
+    static constexpr std::size_t arity = sizeof...(Args);
+
+    CallId nextCallId() {
+        if constexpr (!hasResult && Config::oneWayCalls) {
+            return 0;
+        } else {
+            return interface->getNextCallId();
+        }
+    }
+
+    /// Runs `handler` of a received call, reporting it to statistics. Cancels and calls past their
+    /// deadline are reported to the interface instead, their payload is not touched
+    template<typename Handler>
+    void measureCall(const RpcPacket<Payload>& packet, Handler&& handler) {
+        auto& stats = interface->getStats();
+        stats.onReceived(functionId, packet.callType, payloadSize(packet.payload));
+        auto* receiver = static_cast<Interface*>(interface);
+        if (packet.callType == CallType::Cancel) {
+            if constexpr (requires { receiver->onCallCancelled(functionId, packet.callId); }) {
+                receiver->onCallCancelled(functionId, packet.callId);
+            }
+            return;
+        }
+
+        if constexpr (Config::deadlines) {
+            if (packet.deadline != noDeadline && packet.deadline <= std::chrono::steady_clock::now()) {
+                if constexpr (requires { receiver->onCallExpired(functionId, packet.callId); }) {
+                    receiver->onCallExpired(functionId, packet.callId);
+                }
+                return;
+            }
+            DeadlineScope scope(packet.deadline);
+            runMeasured(handler);
+        } else {
+            runMeasured(handler);
+        }
+    }
+
+    template<typename Handler>
+    void runMeasured(Handler& handler) {
+        if constexpr (Config::Stats::enabled) {
+            const auto start = std::chrono::steady_clock::now();
+            handler();
+            interface->getStats().onHandled(functionId, std::chrono::steady_clock::now() - start);
+        } else {
+            handler();
+        }
+    }
+
+    void handleCall(const RpcPacket<Payload>& packet) {
+        using Tuple = ArgsTuple<Args...>;
+        measureCall(packet, [&] {
+            if constexpr (!hasResult) {
+                std::apply(remoteCallback, packet.payload.template deserialize<Tuple>());
+            } else {
+                respond(packet, [&] { return std::apply(remoteCallback, packet.payload.template deserialize<Tuple>()); });
+            }
+        });
+    }
+
+    void handleResult(const RpcPacket<Payload>& packet) {
+        auto& stats = interface->getStats();
+        stats.onReceived(functionId, CallType::Response, payloadSize(packet.payload));
+        stats.onResultReturned(functionId, packet.callId);
+        const auto& result = packet.payload.template deserialize<std::tuple<ReturnType>>();
+        static_cast<Interface*>(interface)->template onResultReturned<ReturnType>(packet.callId, std::get<0>(result));
+    }
+
+    static void onCall(void* self, const RpcPacket<Payload>& packet) {
+        static_cast<RpcCall*>(self)->handleCall(packet);
+    }
+
+    static void onResult(void* self, const RpcPacket<Payload>& packet) {
+        static_cast<RpcCall*>(self)->handleResult(packet);
+    }
+
+    Callback remoteCallback;
+    RpcInterface<Interface, Payload, Config>* interface;
+    FunctionId functionId = 0;
+    uint32_t compressionThreshold = 0;
+    std::chrono::nanoseconds timeout{0};
+    std::unique_ptr<ResultCache<Payload>> resultCache;
+};
+
+
+/// Coalesced packet payload is a single `std::vector<ArgsTuple<Args...>>` argument
+template <class Interface, typename Payload, typename Config, typename ...Args, std::size_t MaxCalls>
+struct RpcCall<Interface, Payload, Config, Coalesced<void(Args...), MaxCalls>>
+    : RpcCall<Interface, Payload, Config, void(Args...)>, BufferedCall {
+    using Base = RpcCall<Interface, Payload, Config, void(Args...)>;
+    using Tuple = ArgsTuple<Args...>;
+    using BulkCallback = InplaceFunction<void(std::span<const Tuple>), Config::callbackCapacity>;
+
+    static_assert(MaxCalls > 0);
+    static_assert(!(isArgumentView<std::remove_cvref_t<Args>> || ...), "Buffered calls can't keep argument views");
+
+    template<class Owner> requires std::is_base_of_v<RpcInterface<Interface, Payload, Config>, Owner>
+    RpcCall(Owner* interface) : Base(interface, typename Base::DeferRegistration{}) {
+        flushCalls = [](BufferedCall* self) { static_cast<RpcCall*>(self)->flush(); };
+        flushCallsIfDue = [](BufferedCall* self, std::chrono::steady_clock::time_point now) {
+            return static_cast<RpcCall*>(self)->flushIfDue(now);
+        };
+        interface->template registerCall<Owner>(*this);
+        interface->registerBufferedCall(*this);
+    }
+
+    // sending from here would reach a partly destroyed interface
+    ~RpcCall() { assert(pending.empty() && "Coalesced calls should be flushed before the interface is destroyed"); }
+
+    using Base::operator=;
+
+    /// binds a handler receiving all calls of a packet at once, instead of calling regular handler for each one
+    template<typename Functor>
+    void bindBulk(Functor&& f) {
+        bulkCallback = BulkCallback(std::forward<Functor>(f));
+    }
+
+    /// Buffered calls are also sent when the first of them waits longer than `delay`, zero disables it.
+    /// It is checked on push and by `RpcInterface::flushIfDue`, which should be called periodically
+    void setMaxDelay(std::chrono::steady_clock::duration delay) {
+        maxDelay = delay;
+    }
+
+    void operator() (Args&& ...args) {
+        push(std::forward<Args>(args)...);
+    }
+
+    template<typename ...CallArgs> requires isCallableWith<void(Args...), CallArgs...>
+    void operator() (CallArgs&& ...args) {
+        push(forwardAs<Args>(std::forward<CallArgs>(args))...);
+    }
+
+    void flush() {
+        if (pending.empty()) {
+            return;
+        }
+        this->template doRemoteCall<CallType::Call>(this->nextCallId(), std::as_const(pending));
+        pending.clear(); // keeps capacity for following calls
+    }
+
+    /// flushes if the oldest buffered call waits longer than `maxDelay`, returns true if it did
+    bool flushIfDue(std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now()) {
+        if (pending.empty() || maxDelay.count() == 0 || now - firstPendingTime < maxDelay) {
+            return false;
+        }
+        flush();
+        return true;
+    }
+
+protected:
+    friend class RpcInterface<Interface, Payload, Config>;
+    template<class, typename, typename> friend struct StaticDispatchTable;
+
+    void handleCall(const RpcPacket<Payload>& packet) {
+        this->measureCall(packet, [&] {
+            auto calls = std::get<0>(packet.payload.template deserialize<std::tuple<std::vector<Tuple>>>());
+            if (bulkCallback) {
+                bulkCallback(std::span<const Tuple>(calls));
+            } else {
+                for (auto& call : calls) {
+                    std::apply(this->remoteCallback, std::move(call));
+                }
+            }
+        });
+    }
+
+    static void onCall(void* self, const RpcPacket<Payload>& packet) {
+        static_cast<RpcCall*>(self)->handleCall(packet);
+    }
+
+    template<typename ...CallArgs>
+    void push(CallArgs&& ...args) {
+        if (maxDelay.count() != 0 && pending.empty()) {
+            firstPendingTime = std::chrono::steady_clock::now();
+        }
+        pending.emplace_back(std::forward<CallArgs>(args)...);
+
+        if (pending.size() >= MaxCalls
+            || (maxDelay.count() != 0 && std::chrono::steady_clock::now() - firstPendingTime >= maxDelay)) {
+            flush();
+        }
+    }
+
+    std::vector<Tuple> pending;
+    BulkCallback bulkCallback;
+    std::chrono::steady_clock::duration maxDelay{0};
+    std::chrono::steady_clock::time_point firstPendingTime;
+};
+
+
+/// Lazy calls use the same packets as regular ones, only the handler differs
+template <class Interface, typename Payload, typename Config, typename ReturnType, typename ...Args>
+struct RpcCall<Interface, Payload, Config, Lazy<ReturnType(Args...)>>
+    : RpcCall<Interface, Payload, Config, ReturnType(Args...)> {
+    using Base = RpcCall<Interface, Payload, Config, ReturnType(Args...)>;
+    using Arguments = LazyArgs<Payload, Args...>;
+    using LazyCallback = InplaceFunction<ReturnType(const Arguments&), Config::callbackCapacity>;
+
+    template<class Owner> requires std::is_base_of_v<RpcInterface<Interface, Payload, Config>, Owner>
+    RpcCall(Owner* interface) : Base(interface, typename Base::DeferRegistration{}) {
+        interface->template registerCall<Owner>(*this);
+    }
+
+    template<typename Functor>
+    void operator = (Functor&& f) {
+        lazyCallback = LazyCallback(std::forward<Functor>(f));
+    }
+
+    template<auto Method, class Object>
+    void bind(Object* object) {
+        lazyCallback = LazyCallback::template bind<Method>(object);
+    }
+
+protected:
+    friend class RpcInterface<Interface, Payload, Config>;
+    template<class, typename, typename> friend struct StaticDispatchTable;
+
+    void handleCall(const RpcPacket<Payload>& packet) {
+        this->measureCall(packet, [&] {
+            const Arguments arguments(packet);
+            if constexpr (!Base::hasResult) {
+                lazyCallback(arguments);
+            } else {
+                this->respond(packet, [&] { return lazyCallback(arguments); });
+            }
+        });
+    }
+
+    static void onCall(void* self, const RpcPacket<Payload>& packet) {
+        static_cast<RpcCall*>(self)->handleCall(packet);
+    }
+
+    LazyCallback lazyCallback;
+};
+
+
+/// Deferred calls use the same packets as regular ones, only the handler differs
+template <class Interface, typename Payload, typename Config, typename ReturnType, typename ...Args>
+struct RpcCall<Interface, Payload, Config, Deferred<ReturnType(Args...)>>
+    : RpcCall<Interface, Payload, Config, ReturnType(Args...)> {
+    using Base = RpcCall<Interface, Payload, Config, ReturnType(Args...)>;
+    using DeferredCallback = InplaceFunction<void(Responder<ReturnType>, Args...), Config::callbackCapacity>;
+
+    static_assert(!std::is_same_v<void, ReturnType>, "Rpcs without result need no responder, use a regular Rpc");
+
+    template<class Owner> requires std::is_base_of_v<RpcInterface<Interface, Payload, Config>, Owner>
+    RpcCall(Owner* interface) : Base(interface, typename Base::DeferRegistration{}) {
+        interface->template registerCall<Owner>(*this);
+    }
+
+    template<typename Functor>
+    void operator = (Functor&& f) {
+        deferredCallback = DeferredCallback(std::forward<Functor>(f));
+    }
+
+    template<auto Method, class Object>
+    void bind(Object* object) {
+        deferredCallback = DeferredCallback::template bind<Method>(object);
+    }
+
+protected:
+    friend class RpcInterface<Interface, Payload, Config>;
+    template<class, typename, typename> friend struct StaticDispatchTable;
+
+    void handleCall(const RpcPacket<Payload>& packet) {
+        using Tuple = ArgsTuple<Args...>;
+        // handler time covers the call only, not the deferred work
+        this->measureCall(packet, [&] {
+            Responder<ReturnType> responder(this, &respond, packet.callId);
+            std::apply([&](auto&& ...args) {
+                deferredCallback(std::move(responder), std::forward<decltype(args)>(args)...);
+            }, packet.payload.template deserialize<Tuple>());
+        });
+    }
+
+    static void respond(void* self, CallId callId, ReturnType&& result) {
+        static_cast<RpcCall*>(self)->template doRemoteCall<CallType::Response>(callId, std::move(result));
+    }
+
+    static void onCall(void* self, const RpcPacket<Payload>& packet) {
+        static_cast<RpcCall*>(self)->handleCall(packet);
+    }
+
+    DeferredCallback deferredCallback;
+
+public:
+    /// results are sent by responders, after the handler returns, so they can't be cached
+    void enableResultCache(std::size_t) = delete;
+};
+
+
+/// Stream calls carry `(credits, optional arguments)`: arguments open a stream, their absence
+/// grants credits to an open one. Responses carry `optional<T>`, empty for the end of the stream
+template <class Interface, typename Payload, typename Config, typename T, typename ...Args>
+struct RpcCall<Interface, Payload, Config, Stream<T(Args...)>>
+    : RpcCall<Interface, Payload, Config, void(Args...)> {
+    using Base = RpcCall<Interface, Payload, Config, void(Args...)>;
+    using Writer = StreamWriter<T>;
+    using StreamCallback = InplaceFunction<void(Writer, Args...), Config::callbackCapacity>;
+
+    static_assert(!std::is_same_v<void, T>, "Stream should have a chunk type");
+
+    template<class Owner> requires std::is_base_of_v<RpcInterface<Interface, Payload, Config>, Owner>
+    RpcCall(Owner* interface) : Base(interface, typename Base::DeferRegistration{}) {
+        interface->template registerCall<Owner>(*this);
+    }
+
+    template<typename Functor>
+    void operator = (Functor&& f) {
+        streamCallback = StreamCallback(std::forward<Functor>(f));
+    }
+
+    template<auto Method, class Object>
+    void bind(Object* object) {
+        streamCallback = StreamCallback::template bind<Method>(object);
+    }
+
+    /// opens a stream, returns its call id
+    CallId operator() (Args&& ...args) {
+        return open(std::forward<Args>(args)...);
+    }
+
+    template<typename ...CallArgs> requires isCallableWith<void(Args...), CallArgs...>
+    CallId operator() (CallArgs&& ...args) {
+        return open(forwardAs<Args>(std::forward<CallArgs>(args))...);
+    }
+
+    /// chunks granted on call, more are granted when a half of them is handled
+    void setWindow(uint32_t chunks) { window = std::max<uint32_t>(chunks, 1); }
+    void setAutoGrant(bool enabled) { autoGrant = enabled; }
+
+    /// lets the writer of stream `callId` send `chunks` more
+    void grant(CallId callId, uint32_t chunks) {
+        this->template doRemoteCall<CallType::Call, false>(callId, chunks, std::optional<Tuple>());
+    }
+
+    /// stops stream `callId`, chunks already sent may still come
+    void cancel(CallId callId) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            handledChunks.erase(callId);
+        }
+        Base::cancel(callId);
+    }
+
+protected:
+    friend class RpcInterface<Interface, Payload, Config>;
+    template<class, typename, typename> friend struct StaticDispatchTable;
+
+    using Tuple = ArgsTuple<Args...>;
+    using Control = std::tuple<uint32_t, std::optional<Tuple>>;
+
+    static constexpr bool hasResult = true;
+
+    template<typename ...CallArgs>
+    CallId open(CallArgs&& ...args) {
+        // streams always take call ids, even with `Config::oneWayCalls`
+        const CallId callId = this->interface->getNextCallId();
+        if (autoGrant) {
+            std::lock_guard<std::mutex> lock(mutex);
+            handledChunks.emplace(callId, 0);
+        }
+        this->template doRemoteCall<CallType::Call>(callId, window, std::optional<Tuple>(std::in_place, std::forward<CallArgs>(args)...));
+        return callId;
+    }
+
+    void handleCall(const RpcPacket<Payload>& packet) {
+        if (packet.callType == CallType::Cancel) {
+            // its writer fails to write from now on and ends nothing
+            std::lock_guard<std::mutex> lock(mutex);
+            writers.erase(packet.callId);
+        }
+        this->measureCall(packet, [&] {
+            auto [credits, arguments] = packet.payload.template deserialize<Control>();
+            if (!arguments) {
+                addCredits(packet.callId, credits);
+                return;
+            }
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                writers[packet.callId].credits = credits;
+            }
+            std::apply([&](auto&& ...args) {
+                streamCallback(Writer(this, &operations, packet.callId), std::forward<decltype(args)>(args)...);
+            }, std::move(*arguments));
+        });
+    }
+
+    void handleResult(const RpcPacket<Payload>& packet) {
+        this->interface->getStats().onReceived(this->functionId, CallType::Response, payloadSize(packet.payload));
+        auto* caller = static_cast<Interface*>(this->interface);
+        auto chunk = std::get<0>(packet.payload.template deserialize<std::tuple<std::optional<T>>>());
+        if (!chunk) {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                handledChunks.erase(packet.callId);
+            }
+            caller->template onStreamEnd<T>(packet.callId);
+            return;
+        }
+
+        caller->template onStreamChunk<T>(packet.callId, *chunk);
+        if (autoGrant) {
+            uint32_t chunks = 0;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                auto it = handledChunks.find(packet.callId);
+                if (it != handledChunks.end() && ++it->second >= std::max<uint32_t>(window / 2, 1)) {
+                    chunks = std::exchange(it->second, 0);
+                }
+            }
+            if (chunks != 0) {
+                grant(packet.callId, chunks);
+            }
+        }
+    }
+
+    void addCredits(CallId callId, uint32_t credits) {
+        typename Writer::Resume resume;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto it = writers.find(callId);
+            if (it == writers.end()) {
+                return; // already closed
+            }
+            it->second.credits += credits;
+            resume = std::move(it->second.resume);
+        }
+        if (resume) {
+            resume(Writer(this, &operations, callId));
+        }
+    }
+
+    static bool write(void* self, CallId callId, T&& chunk) {
+        auto* call = static_cast<RpcCall*>(self);
+        {
+            std::lock_guard<std::mutex> lock(call->mutex);
+            auto it = call->writers.find(callId);
+            if (it == call->writers.end() || it->second.credits == 0) {
+                return false;
+            }
+            --it->second.credits;
+        }
+        call->template doRemoteCall<CallType::Response>(callId, std::optional<T>(std::move(chunk)));
+        return true;
+    }
+
+    static void close(void* self, CallId callId) {
+        auto* call = static_cast<RpcCall*>(self);
+        {
+            std::lock_guard<std::mutex> lock(call->mutex);
+            if (call->writers.erase(callId) == 0) {
+                return; // cancelled
+            }
+        }
+        call->template doRemoteCall<CallType::Response>(callId, std::optional<T>());
+    }
+
+    static uint32_t credits(void* self, CallId callId) {
+        auto* call = static_cast<RpcCall*>(self);
+        std::lock_guard<std::mutex> lock(call->mutex);
+        auto it = call->writers.find(callId);
+        return it != call->writers.end() ? it->second.credits : 0;
+    }
+
+    static void suspend(void* self, CallId callId, typename Writer::Resume&& resume) {
+        auto* call = static_cast<RpcCall*>(self);
+        {
+            std::lock_guard<std::mutex> lock(call->mutex);
+            auto it = call->writers.find(callId);
+            if (it != call->writers.end() && it->second.credits == 0) {
+                it->second.resume = std::move(resume);
+                return;
+            }
+        }
+        resume(Writer(self, &operations, callId));
+    }
+
+    static void onCall(void* self, const RpcPacket<Payload>& packet) {
+        static_cast<RpcCall*>(self)->handleCall(packet);
+    }
+
+    static void onResult(void* self, const RpcPacket<Payload>& packet) {
+        static_cast<RpcCall*>(self)->handleResult(packet);
+    }
+
+    struct WriterState {
+        uint32_t credits = 0;
+        typename Writer::Resume resume;
+    };
+
+    static constexpr typename Writer::Operations operations{&write, &close, &credits, &suspend};
+
+    StreamCallback streamCallback;
+    uint32_t window = defaultStreamWindow;
+    bool autoGrant = true;
+
+    std::mutex mutex;
+    std::unordered_map<CallId, WriterState> writers;  // receiver side, open streams
+    std::unordered_map<CallId, uint32_t> handledChunks; // caller side, chunks handled since the last grant
+};
+
+
+/// Named Rpcs are the wrapped kind with a fixed FunctionId, set on registration
+template <class Interface, typename Payload, typename Config, FixedString Name, typename Signature>
+struct RpcCall<Interface, Payload, Config, Named<Name, Signature>>
+    : RpcCall<Interface, Payload, Config, Signature> {
+    using Base = RpcCall<Interface, Payload, Config, Signature>;
+
+    template<class Owner> requires std::is_base_of_v<RpcInterface<Interface, Payload, Config>, Owner>
+    RpcCall(Owner* interface) : Base(interface) {
+        static_assert(HasRpcList<Interface>::value, "Named Rpcs need Interface::RpcMembers");
+    }
+
+    using Base::operator=;
+
+    static constexpr std::string_view name = Name.view();
+    static constexpr FunctionId namedId = namedFunctionId(name, Base::arity, Base::hasResult);
 };
 
 } // namespace rpc
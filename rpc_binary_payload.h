@@ -0,0 +1,477 @@
+#pragma once
+#include "rpc.h"
+
+#include <array>
+#include <iterator>
+#include <memory>
+#include <optional>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+namespace rpc {
+
+/// Thrown when payload bytes can't be decoded into requested arguments
+struct PayloadError : std::runtime_error {
+    using std::runtime_error::runtime_error;
+};
+
+namespace binary {
+
+/// Wire format:
+/// - trivially copyable values are stored as is, in host byte order
+/// - strings and containers are prefixed with `uint32_t` element count
+/// - tuples, pairs and arrays are stored element by element
+/// - `std::optional` is prefixed with a `uint8_t` presence flag
+/// View types are encoded the same way as containers they refer to:
+/// `std::string_view` as `std::string`, `std::span<const std::byte>` as `std::vector<std::byte>` and
+/// `SequenceView<T>` as `std::vector<T>`, so views and owning types can be mixed on both sides
+using SizePrefix = uint32_t;
+
+template<typename T> class SequenceView;
+
+template<typename T> struct IsSequenceView : std::false_type {};
+template<typename T> struct IsSequenceView<SequenceView<T>> : std::true_type {};
+
+/// views decoded as a pointer into payload, only byte-sized elements as there is no alignment guarantee
+template<typename T>
+concept ByteView = isArgumentView<T> && !IsSequenceView<T>::value && sizeof(typename T::value_type) == 1
+    && std::is_const_v<std::remove_pointer_t<decltype(std::declval<T>().data())>>;
+
+template<typename T> struct IsTupleLike : std::false_type {};
+template<typename ...T> struct IsTupleLike<std::tuple<T...>> : std::true_type {};
+template<typename A, typename B> struct IsTupleLike<std::pair<A, B>> : std::true_type {};
+
+template<typename T> struct IsOptional : std::false_type {};
+template<typename T> struct IsOptional<std::optional<T>> : std::true_type {};
+
+template<typename T> struct IsStdArray : std::false_type {};
+template<typename T, std::size_t N> struct IsStdArray<std::array<T, N>> : std::true_type {};
+
+template<typename T>
+concept Trivial = std::is_trivially_copyable_v<T> && !std::is_pointer_v<T> && !isArgumentView<T>
+    && !IsTupleLike<T>::value && !IsStdArray<T>::value;
+
+template<typename T>
+concept Container = !Trivial<T> && requires(const T& c) {
+    typename T::value_type;
+    c.begin();
+    c.end();
+    c.size();
+};
+
+template<typename T>
+struct DecodedElement {
+    using type = std::remove_cv_t<typename T::value_type>;
+};
+
+/// map elements are `pair<const K, V>`, so they are decoded as assignable pairs
+template<typename T> requires requires { typename T::mapped_type; }
+struct DecodedElement<T> {
+    using type = std::pair<typename T::key_type, typename T::mapped_type>;
+};
+
+/// Encoded size of T if it does not depend on a value, 0 otherwise
+template<typename T>
+constexpr std::size_t fixedSize() {
+    if constexpr (Trivial<T>) {
+        return sizeof(T);
+    } else if constexpr (IsTupleLike<T>::value) {
+        return []<std::size_t ...I>(std::index_sequence<I...>) {
+            constexpr std::size_t sizes[] = {fixedSize<std::tuple_element_t<I, T>>()..., 0};
+            std::size_t total = 0;
+            for (std::size_t i = 0; i < sizeof...(I); ++i) {
+                if (sizes[i] == 0) {
+                    return std::size_t(0);
+                }
+                total += sizes[i];
+            }
+            return total;
+        }(std::make_index_sequence<std::tuple_size_v<T>>{});
+    } else if constexpr (IsStdArray<T>::value) {
+        return std::tuple_size_v<T> * fixedSize<typename T::value_type>();
+    } else {
+        return 0;
+    }
+}
+
+template<typename T>
+std::size_t encodedSize(const T& value) {
+    if constexpr (fixedSize<T>() != 0) {
+        return fixedSize<T>();
+    } else if constexpr (IsTupleLike<T>::value || IsStdArray<T>::value) {
+        return std::apply([](const auto& ...elements) { return (std::size_t(0) + ... + encodedSize(elements)); }, value);
+    } else if constexpr (IsOptional<T>::value) {
+        return 1 + (value ? encodedSize(*value) : 0);
+    } else if constexpr (IsSequenceView<T>::value) {
+        return sizeof(SizePrefix) + value.encodedElementsSize();
+    } else if constexpr (Container<T>) {
+        using Element = std::remove_cv_t<typename T::value_type>;
+        if constexpr (fixedSize<Element>() != 0) {
+            return sizeof(SizePrefix) + value.size() * fixedSize<Element>();
+        } else {
+            std::size_t total = sizeof(SizePrefix);
+            for (const auto& element : value) {
+                total += encodedSize(element);
+            }
+            return total;
+        }
+    } else {
+        static_assert(sizeof(T) == 0, "Type is not supported by BinaryPayload");
+    }
+}
+
+/// Leaves elements added by `resize` uninitialized, payload buffers are overwritten right after growing
+template<typename T>
+struct UninitializedAllocator : std::allocator<T> {
+    template<typename U> struct rebind { using other = UninitializedAllocator<U>; };
+
+    UninitializedAllocator() = default;
+    template<typename U> UninitializedAllocator(const UninitializedAllocator<U>&) noexcept {}
+
+    template<typename U>
+    void construct(U* p) noexcept(std::is_nothrow_default_constructible_v<U>) {
+        ::new (static_cast<void*>(p)) U;
+    }
+
+    template<typename U, typename ...Args>
+    void construct(U* p, Args&& ...args) {
+        std::construct_at(p, std::forward<Args>(args)...);
+    }
+};
+
+using Buffer = std::vector<std::byte, UninitializedAllocator<std::byte>>;
+
+/// Writes into preallocated memory, sizes are checked by `encodedSize` beforehand
+struct Writer {
+    std::byte* position;
+
+    void write(const void* data, std::size_t size) {
+        std::memcpy(position, data, size);
+        position += size;
+    }
+
+    template<typename T>
+    void encode(const T& value) {
+        if constexpr (Trivial<T>) {
+            write(&value, sizeof(T));
+        } else if constexpr (IsTupleLike<T>::value || IsStdArray<T>::value) {
+            std::apply([this](const auto& ...elements) { (encode(elements), ...); }, value);
+        } else if constexpr (IsOptional<T>::value) {
+            encode(uint8_t(value.has_value()));
+            if (value) {
+                encode(*value);
+            }
+        } else if constexpr (IsSequenceView<T>::value) {
+            encode(SizePrefix(value.size()));
+            value.encodeElements(*this);
+        } else if constexpr (Container<T>) {
+            using Element = std::remove_cv_t<typename T::value_type>;
+            encode(SizePrefix(value.size()));
+            if constexpr (Trivial<Element> && requires { value.data(); }) {
+                write(value.data(), value.size() * sizeof(Element)); // contiguous: a single copy
+            } else {
+                for (const auto& element : value) {
+                    encode(element);
+                }
+            }
+        }
+    }
+};
+
+struct Reader {
+    const std::byte* position;
+    const std::byte* end;
+
+    const std::byte* take(std::size_t size) {
+        if (std::size_t(end - position) < size) {
+            throw PayloadError("BinaryPayload: unexpected end of data");
+        }
+        auto* data = position;
+        position += size;
+        return data;
+    }
+
+    template<typename T>
+    T decode() {
+        if constexpr (Trivial<T>) {
+            T value;
+            std::memcpy(&value, take(sizeof(T)), sizeof(T));
+            return value;
+        } else if constexpr (IsTupleLike<T>::value || IsStdArray<T>::value) {
+            return decodeElements<T>(std::make_index_sequence<std::tuple_size_v<T>>{});
+        } else if constexpr (IsOptional<T>::value) {
+            if (decode<uint8_t>() == 0) {
+                return std::nullopt;
+            }
+            return decode<typename T::value_type>();
+        } else if constexpr (ByteView<T>) {
+            static_assert(std::is_trivially_copyable_v<typename T::value_type>);
+            const auto count = decode<SizePrefix>();
+            const auto* data = take(count);
+            return T(reinterpret_cast<decltype(std::declval<T>().data())>(data), count);
+        } else if constexpr (IsSequenceView<T>::value) {
+            const auto count = decode<SizePrefix>();
+            const auto* begin = position;
+            for (SizePrefix i = 0; i < count; ++i) {
+                skip<typename T::value_type>();
+            }
+            return T(std::span<const std::byte>(begin, position), count);
+        } else if constexpr (Container<T>) {
+            using Element = std::remove_cv_t<typename T::value_type>;
+            const auto count = decode<SizePrefix>();
+            T container = makeContainer<T>();
+            if constexpr (Trivial<Element> && requires { container.resize(count); container.data(); }) {
+                const auto* data = take(std::size_t(count) * sizeof(Element));
+                container.resize(count);
+                std::memcpy(container.data(), data, std::size_t(count) * sizeof(Element));
+            } else {
+                if constexpr (requires { container.reserve(count); }) {
+                    // every element takes at least a byte, don't trust count from the wire blindly
+                    container.reserve(std::min<std::size_t>(count, std::size_t(end - position)));
+                }
+                for (SizePrefix i = 0; i < count; ++i) {
+                    container.insert(container.end(), decode<typename DecodedElement<T>::type>());
+                }
+            }
+            return container;
+        } else {
+            static_assert(sizeof(T) == 0, "Type is not supported by BinaryPayload");
+        }
+    }
+
+    /// allocator-aware containers are allocated from `rpc::argumentResource()`
+    template<typename T>
+    static T makeContainer() {
+        if constexpr (requires { typename T::allocator_type; }
+                      && std::is_constructible_v<typename T::allocator_type, std::pmr::memory_resource*>) {
+            return T(typename T::allocator_type(argumentResource()));
+        } else {
+            return T();
+        }
+    }
+
+    template<typename T, std::size_t ...I>
+    T decodeElements(std::index_sequence<I...>) {
+        // braced init guarantees left to right evaluation
+        return T{decode<std::remove_cv_t<std::tuple_element_t<I, T>>>()...};
+    }
+
+    /// moves past encoded `T` without decoding it
+    template<typename T>
+    void skip() {
+        if constexpr (fixedSize<T>() != 0) {
+            take(fixedSize<T>());
+        } else if constexpr (IsTupleLike<T>::value || IsStdArray<T>::value) {
+            [this]<std::size_t ...I>(std::index_sequence<I...>) {
+                (skip<std::remove_cv_t<std::tuple_element_t<I, T>>>(), ...);
+            }(std::make_index_sequence<std::tuple_size_v<T>>{});
+        } else if constexpr (IsOptional<T>::value) {
+            if (decode<uint8_t>() != 0) {
+                skip<typename T::value_type>();
+            }
+        } else if constexpr (Container<T>) {
+            using Element = typename DecodedElement<T>::type;
+            const auto count = decode<SizePrefix>();
+            if constexpr (fixedSize<Element>() != 0) {
+                take(std::size_t(count) * fixedSize<Element>());
+            } else {
+                for (SizePrefix i = 0; i < count; ++i) {
+                    skip<Element>();
+                }
+            }
+        } else {
+            static_assert(sizeof(T) == 0, "Type is not supported by BinaryPayload");
+        }
+    }
+};
+
+/// Lazily decoded sequence of `T`, encoded as `std::vector<T>`. Elements are decoded one by one
+/// while iterating, so nothing is materialized. `T` may itself contain views:
+///
+/// ```
+/// Rpc<void(rpc::binary::MapView<std::string_view, int> phonebook)> addPhonebook = this;
+///
+/// sender.addPhonebook(phonebookMap); // any container which elements are encoded like `T`
+/// receiver.addPhonebook = [](rpc::binary::MapView<std::string_view, int> phonebook) {
+///     for (auto [name, number] : phonebook) { /*...*/ }
+/// };
+/// ```
+template<typename T>
+class SequenceView {
+public:
+    using value_type = T;
+
+    class iterator {
+    public:
+        using iterator_category = std::input_iterator_tag;
+        using value_type = T;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const T*;
+        using reference = const T&;
+
+        iterator() = default;
+
+        const T& operator* () const { return current; }
+        const T* operator-> () const { return &current; }
+
+        iterator& operator++ () {
+            if (--remaining != 0) {
+                current = reader.decode<T>();
+            }
+            return *this;
+        }
+        void operator++ (int) { ++*this; }
+
+        bool operator == (const iterator& other) const { return remaining == other.remaining; }
+
+    private:
+        friend class SequenceView;
+        iterator(Reader reader, std::size_t count) : reader(reader), remaining(count) {
+            if (remaining != 0) {
+                current = this->reader.template decode<T>();
+            }
+        }
+
+        Reader reader{nullptr, nullptr};
+        std::size_t remaining = 0;
+        T current{};
+    };
+
+    SequenceView() = default;
+
+    /// sender side view of a `source` container, it is encoded element by element when sent
+    template<typename Source> requires (Container<Source> && !IsSequenceView<Source>::value)
+    SequenceView(const Source& source) : source(&source), count(source.size()) {
+        static_assert(std::is_convertible_v<const typename Source::value_type&, T>,
+                      "Source elements should be encoded like view elements");
+        encodeSource = [](Writer& writer, const void* source) {
+            for (const auto& element : *static_cast<const Source*>(source)) {
+                writer.encode(element);
+            }
+        };
+        sourceSize = [](const void* source) {
+            return encodedSize(*static_cast<const Source*>(source)) - sizeof(SizePrefix);
+        };
+    }
+
+    /// receiver side view of `count` encoded elements
+    SequenceView(std::span<const std::byte> encoded, std::size_t count) : encoded(encoded), count(count) {}
+
+    std::size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+
+    /// only receiver side views can be iterated
+    iterator begin() const {
+        assert(source == nullptr);
+        return iterator(Reader{encoded.data(), encoded.data() + encoded.size()}, count);
+    }
+    iterator end() const { return {}; }
+
+    std::size_t encodedElementsSize() const {
+        return source ? sourceSize(source) : encoded.size();
+    }
+
+    void encodeElements(Writer& writer) const {
+        if (source) {
+            encodeSource(writer, source);
+        } else {
+            writer.write(encoded.data(), encoded.size()); // forwarded as is
+        }
+    }
+
+private:
+    const void* source = nullptr;
+    void(*encodeSource)(Writer&, const void*) = nullptr;
+    std::size_t(*sourceSize)(const void*) = nullptr;
+    std::span<const std::byte> encoded;
+    std::size_t count = 0;
+};
+
+template<typename K, typename V>
+using MapView = SequenceView<std::pair<K, V>>;
+
+} // namespace binary
+
+template<typename T> inline constexpr bool isArgumentView<binary::SequenceView<T>> = true;
+
+/// Reference `Payload` implementation storing arguments in a contiguous byte buffer.
+/// Buffer is sized once per call: exactly at compile time for fixed-size argument packs,
+/// or after computing encoded size of variable-size arguments. Growing it does not zero it, so
+/// every byte is written once, trivially copyable arguments with a single `memcpy` each.
+/// Deserialized `std::pmr` containers are allocated from the active `rpc::ArgumentArena`.
+/// Rpcs declared with `std::string_view`, `std::span<const std::byte>` or `binary::SequenceView`
+/// arguments are deserialized without copies, views point into this buffer.
+/// The first `PrefixSize` bytes are left to payloads built on top of it, e.g. `CompressedPayload`
+template<std::size_t PrefixSize>
+class BasicBinaryPayload {
+public:
+    template<typename ...Args>
+    void serialize(Args&& ...args) {
+        std::size_t size;
+        if constexpr (constexpr std::size_t fixed = binary::fixedSize<ArgsTuple<Args...>>(); fixed != 0) {
+            size = fixed;
+        } else {
+            size = (std::size_t(0) + ... + binary::encodedSize(args));
+        }
+        borrowed = {};
+        buffer.resize(PrefixSize + size);
+        [[maybe_unused]] binary::Writer writer{buffer.data() + PrefixSize}; // unused for Rpcs without arguments
+        (writer.encode(args), ...);
+    }
+
+    template<typename Tuple>
+    Tuple deserialize() const {
+        const auto contents = bytes();
+        binary::Reader reader{arguments(contents), contents.data() + contents.size()};
+        return reader.decode<Tuple>();
+    }
+
+    /// decodes only argument `I` of `Tuple`, arguments before it are skipped, not decoded
+    template<typename Tuple, std::size_t I>
+    std::tuple_element_t<I, Tuple> deserializeArgument() const {
+        const auto contents = bytes();
+        binary::Reader reader{arguments(contents), contents.data() + contents.size()};
+        [&]<std::size_t... J>(std::index_sequence<J...>) {
+            (reader.skip<std::tuple_element_t<J, Tuple>>(), ...);
+        }(std::make_index_sequence<I>{});
+        return reader.decode<std::tuple_element_t<I, Tuple>>();
+    }
+
+    /// raw bytes for transports
+    std::span<const std::byte> bytes() const { return borrowed.data() ? borrowed : std::span<const std::byte>(buffer); }
+
+    void assign(std::span<const std::byte> bytes) {
+        borrowed = {};
+        buffer.assign(bytes.begin(), bytes.end());
+    }
+
+    /// Refers to `bytes` instead of copying them, e.g. to replay a mapped packet log. They should stay
+    /// valid until the next `serialize`, `assign`, `borrow` or `clear`, as should deserialized views
+    void borrow(std::span<const std::byte> bytes) {
+        buffer.clear();
+        borrowed = bytes;
+    }
+
+    /// drops content but keeps allocated capacity
+    void clear() {
+        borrowed = {};
+        buffer.clear();
+    }
+
+protected:
+    // payloads shorter than the prefix decode as empty ones
+    static const std::byte* arguments(std::span<const std::byte> contents) {
+        return contents.data() + std::min(PrefixSize, contents.size());
+    }
+
+    binary::Buffer buffer;
+    std::span<const std::byte> borrowed; // refers to bytes of someone else if not null
+};
+
+using BinaryPayload = BasicBinaryPayload<0>;
+
+} // namespace rpc
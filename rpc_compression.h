@@ -0,0 +1,200 @@
+#pragma once
+#include "rpc_binary_payload.h"
+
+#include <concepts>
+#include <cstring>
+#include <span>
+#include <vector>
+
+#if __has_include(<lz4.h>)
+#include <lz4.h>
+#define RPC_HAS_LZ4 1
+#endif
+
+#if __has_include(<zstd.h>)
+#include <zstd.h>
+#define RPC_HAS_ZSTD 1
+#endif
+
+namespace rpc {
+
+/// Compression algorithm of `CompressedPayload`:
+///
+/// ```
+/// static std::size_t maxCompressedSize(std::size_t size);
+/// static std::size_t compress(std::span<const std::byte> in, std::span<std::byte> out);  // 0 if it failed
+/// static bool decompress(std::span<const std::byte> in, std::span<std::byte> out);       // fills `out` exactly
+/// ```
+template<typename Codec>
+concept CompressionCodec = requires(std::span<const std::byte> in, std::span<std::byte> out) {
+    { Codec::maxCompressedSize(std::size_t()) } -> std::convertible_to<std::size_t>;
+    { Codec::compress(in, out) } -> std::convertible_to<std::size_t>;
+    { Codec::decompress(in, out) } -> std::convertible_to<bool>;
+};
+
+#ifdef RPC_HAS_LZ4
+/// LZ4 block compression, fast enough to pay off on links of a few Gbit/s. Link with `-llz4`
+struct Lz4Codec {
+    static std::size_t maxCompressedSize(std::size_t size) {
+        return std::size_t(LZ4_compressBound(int(size)));
+    }
+
+    static std::size_t compress(std::span<const std::byte> in, std::span<std::byte> out) {
+        const int size = LZ4_compress_default(reinterpret_cast<const char*>(in.data()), reinterpret_cast<char*>(out.data()),
+                                              int(in.size()), int(out.size()));
+        return size > 0 ? std::size_t(size) : 0;
+    }
+
+    static bool decompress(std::span<const std::byte> in, std::span<std::byte> out) {
+        return LZ4_decompress_safe(reinterpret_cast<const char*>(in.data()), reinterpret_cast<char*>(out.data()),
+                                   int(in.size()), int(out.size())) == int(out.size());
+    }
+};
+#endif
+
+#ifdef RPC_HAS_ZSTD
+/// Zstandard at `Level`, compresses better than LZ4 at some CPU cost. Link with `-lzstd`
+template<int Level = 1>
+struct ZstdCodec {
+    static std::size_t maxCompressedSize(std::size_t size) {
+        return ZSTD_compressBound(size);
+    }
+
+    static std::size_t compress(std::span<const std::byte> in, std::span<std::byte> out) {
+        const std::size_t size = ZSTD_compress(out.data(), out.size(), in.data(), in.size(), Level);
+        return ZSTD_isError(size) ? 0 : size;
+    }
+
+    static bool decompress(std::span<const std::byte> in, std::span<std::byte> out) {
+        return ZSTD_decompress(out.data(), out.size(), in.data(), in.size()) == out.size();
+    }
+};
+#endif
+
+#if defined(RPC_HAS_LZ4)
+using DefaultCompressionCodec = Lz4Codec;
+#elif defined(RPC_HAS_ZSTD)
+using DefaultCompressionCodec = ZstdCodec<>;
+#endif
+
+/// `BinaryPayload` that may be compressed by `Codec`. Its first byte tells whether the rest is
+/// compressed, then compressed payloads store the `uint32_t` size of the arguments:
+///
+/// ```
+/// using Payload = rpc::CompressedPayload<rpc::Lz4Codec>;
+///
+/// sender.addPhonebook.setCompressionThreshold(4096);   // calls taking 4KiB or more are compressed
+/// receiver.addPhonebook.setCompressionThreshold(4096); // and so are results, if the Rpc had any
+/// ```
+/// The threshold applies to payloads the side setting it sends. Rpcs call `compress(threshold)` after
+/// serializing arguments if they have one, so calls of other Rpcs only pay for the flag byte. Kept only
+/// if it makes payload smaller. Transports receive payloads with `assign`, which decompresses them right
+/// away into this payload's own buffer, so with `Config::packetPoolSize` it is a pooled one and handlers
+/// see plain arguments, views included. Compressed payloads handed over without `assign`, e.g. by moving
+/// packets in process, throw `PayloadError` on `deserialize`. Both sides should use the same `Codec`
+template<CompressionCodec Codec>
+class CompressedPayload : public BasicBinaryPayload<1> {
+    using Base = BasicBinaryPayload<1>;
+
+public:
+    /// larger arguments are rejected by `assign`
+    static constexpr std::size_t maxArgumentsSize = 64 * 1024 * 1024;
+
+    template<typename ...Args>
+    void serialize(Args&& ...args) {
+        Base::serialize(std::forward<Args>(args)...);
+        buffer[0] = plain;
+    }
+
+    /// compresses serialized arguments taking at least `threshold` bytes, borrowed ones are left as is
+    void compress(std::size_t threshold) {
+        if (buffer.empty()) {
+            return;
+        }
+        const std::size_t size = buffer.size() - 1;
+        if (buffer[0] != plain || size < threshold || size > maxArgumentsSize) {
+            return;
+        }
+        auto& output = scratch();
+        output.resize(headerSize + Codec::maxCompressedSize(size));
+        const std::size_t compressedSize = Codec::compress(std::span<const std::byte>(buffer).subspan(1),
+                                                           std::span<std::byte>(output).subspan(headerSize));
+        if (compressedSize == 0 || headerSize + compressedSize >= buffer.size()) {
+            return; // incompressible
+        }
+        output.resize(headerSize + compressedSize);
+        output[0] = compressed;
+        const uint32_t originalSize = wire::toLittleEndian(uint32_t(size));
+        std::memcpy(output.data() + 1, &originalSize, sizeof(originalSize));
+        buffer.swap(output); // scratch keeps the plain buffer for the next call
+    }
+
+    bool isCompressed() const {
+        const auto contents = bytes();
+        return !contents.empty() && contents[0] == compressed;
+    }
+
+    template<typename Tuple>
+    Tuple deserialize() const {
+        checkPlain();
+        return Base::template deserialize<Tuple>();
+    }
+
+    template<typename Tuple, std::size_t I>
+    std::tuple_element_t<I, Tuple> deserializeArgument() const {
+        checkPlain();
+        return Base::template deserializeArgument<Tuple, I>();
+    }
+
+    /// borrows plain bytes, compressed ones are decompressed as by `assign`
+    void borrow(std::span<const std::byte> bytes) {
+        if (bytes.empty() || bytes[0] != compressed) {
+            Base::borrow(bytes);
+        } else {
+            assign(bytes);
+        }
+    }
+
+    /// takes received bytes, decompressing them. Throws `PayloadError` if they can't be decompressed
+    void assign(std::span<const std::byte> bytes) {
+        if (bytes.empty() || bytes[0] != compressed) {
+            Base::assign(bytes);
+            return;
+        }
+        borrowed = {};
+        if (bytes.size() < headerSize) {
+            throw PayloadError("CompressedPayload: truncated header");
+        }
+        uint32_t size;
+        std::memcpy(&size, bytes.data() + 1, sizeof(size));
+        size = wire::toLittleEndian(size);
+        if (size > maxArgumentsSize) {
+            throw PayloadError("CompressedPayload: arguments are too large");
+        }
+        buffer.resize(1 + std::size_t(size));
+        buffer[0] = plain;
+        if (!Codec::decompress(bytes.subspan(headerSize), std::span<std::byte>(buffer).subspan(1))) {
+            buffer.clear();
+            throw PayloadError("CompressedPayload: corrupted data");
+        }
+    }
+
+private:
+    // arguments are decompressed only by `assign`
+    void checkPlain() const {
+        if (isCompressed()) {
+            throw PayloadError("CompressedPayload: compressed payload was not received with assign");
+        }
+    }
+
+    static constexpr std::byte plain{0};
+    static constexpr std::byte compressed{1};
+    static constexpr std::size_t headerSize = 1 + sizeof(uint32_t);
+
+    static binary::Buffer& scratch() {
+        thread_local binary::Buffer buffer;
+        return buffer;
+    }
+};
+
+} // namespace rpc
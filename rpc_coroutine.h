@@ -0,0 +1,333 @@
+#pragma once
+#include "rpc_future.h"
+
+#include <atomic>
+#include <cassert>
+#include <coroutine>
+#include <exception>
+#include <thread>
+
+namespace rpc {
+
+/// Free lists of coroutine frames in `granularity`-sized classes. Frames bigger than `maxPooledSize`
+/// go to global `operator new`. A pool belongs to the thread allocating from it, e.g. the event loop
+/// of an interface, frames freed on other threads, as when results are dispatched elsewhere, go to
+/// a lock-free return list that the owner takes back once a free list runs out. Give an interface
+/// `FramePool& framePool()` to allocate frames of its member `Task` coroutines there, other tasks
+/// use a per-thread pool
+class FramePool {
+public:
+    static constexpr std::size_t granularity = 64;
+    static constexpr std::size_t maxPooledSize = 4096;
+
+    FramePool() = default;
+    FramePool(const FramePool&) = delete;
+    FramePool& operator = (const FramePool&) = delete;
+
+    ~FramePool() {
+        freeAll(returned.exchange(nullptr, std::memory_order_acquire));
+        for (auto* block : freeLists) {
+            freeAll(block);
+        }
+    }
+
+    /// only on the owning thread, the first thread calling it becomes the owner
+    void* allocate(std::size_t size) {
+        if (size > maxPooledSize) {
+            return ::operator new(size);
+        }
+        if (std::thread::id unowned; owner.load(std::memory_order_relaxed) == unowned) {
+            owner.compare_exchange_strong(unowned, std::this_thread::get_id(), std::memory_order_relaxed);
+        }
+        assert(owner.load(std::memory_order_relaxed) == std::this_thread::get_id() && "FramePool allocates on one thread");
+        const std::size_t index = sizeClass(size);
+        if (!freeLists[index]) {
+            takeReturned();
+        }
+        auto*& head = freeLists[index];
+        if (!head) {
+            return ::operator new(roundUp(size));
+        }
+        return std::exchange(head, head->next);
+    }
+
+    /// on any thread, only the owner puts frames straight back to free lists, before a pool has
+    /// an owner they are returned as from other threads
+    void deallocate(void* frame, std::size_t size) noexcept {
+        if (size > maxPooledSize) {
+            ::operator delete(frame);
+            return;
+        }
+        const std::size_t index = sizeClass(size);
+        if (owner.load(std::memory_order_relaxed) == std::this_thread::get_id()) {
+            auto*& head = freeLists[index];
+            head = ::new (frame) FreeBlock{head, index};
+            return;
+        }
+        auto* block = ::new (frame) FreeBlock{returned.load(std::memory_order_relaxed), index};
+        while (!returned.compare_exchange_weak(block->next, block, std::memory_order_release, std::memory_order_relaxed)) {
+        }
+    }
+
+    static FramePool& local() {
+        thread_local FramePool pool;
+        return pool;
+    }
+
+private:
+    struct FreeBlock {
+        FreeBlock* next;
+        std::size_t sizeClass;
+    };
+
+    // the owner takes the whole list at once, so pushes can't see a popped block again
+    void takeReturned() {
+        for (auto* block = returned.exchange(nullptr, std::memory_order_acquire); block;) {
+            auto* next = block->next;
+            auto*& head = freeLists[block->sizeClass];
+            block->next = head;
+            head = block;
+            block = next;
+        }
+    }
+
+    static void freeAll(FreeBlock* block) {
+        while (block) {
+            ::operator delete(std::exchange(block, block->next));
+        }
+    }
+
+    static constexpr std::size_t sizeClass(std::size_t size) { return (size + granularity - 1) / granularity - 1; }
+    static constexpr std::size_t roundUp(std::size_t size) { return (sizeClass(size) + 1) * granularity; }
+
+    FreeBlock* freeLists[maxPooledSize / granularity] = {};
+    std::atomic<FreeBlock*> returned{nullptr};
+    std::atomic<std::thread::id> owner{};
+};
+
+template<class T>
+concept HasFramePool = requires(T& t) { { t.framePool() } -> std::same_as<FramePool&>; };
+
+template<typename T> class Task;
+
+namespace detail {
+
+// frames are prefixed with the owning pool so they go back to it from any thread,
+// null means a per-thread pool, and the frame goes to the pool of the freeing thread
+struct alignas(std::max_align_t) FrameHeader {
+    FramePool* pool;
+};
+
+inline void* allocateFrame(FramePool* pool, std::size_t size) {
+    auto* header = static_cast<FrameHeader*>((pool ? *pool : FramePool::local()).allocate(size + sizeof(FrameHeader)));
+    header->pool = pool;
+    return header + 1;
+}
+
+inline void deallocateFrame(void* frame, std::size_t size) noexcept {
+    auto* header = static_cast<FrameHeader*>(frame) - 1;
+    (header->pool ? *header->pool : FramePool::local()).deallocate(header, size + sizeof(FrameHeader));
+}
+
+class TaskPromiseBase {
+public:
+    static void* operator new(std::size_t size) { return allocateFrame(nullptr, size); }
+
+    /// member coroutines of interfaces with `framePool()` use that pool
+    template<HasFramePool Owner, typename ...Args>
+    static void* operator new(std::size_t size, Owner& owner, Args&...) { return allocateFrame(&owner.framePool(), size); }
+
+    static void operator delete(void* frame, std::size_t size) noexcept { deallocateFrame(frame, size); }
+
+    std::suspend_always initial_suspend() noexcept { return {}; }
+
+    struct FinalAwaiter {
+        bool await_ready() noexcept { return false; }
+
+        template<typename Promise>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) noexcept {
+            auto& promise = handle.promise();
+            if (promise.continuation) {
+                return promise.continuation;
+            }
+            if (promise.detached) {
+                handle.destroy();
+            }
+            return std::noop_coroutine();
+        }
+
+        void await_resume() noexcept {}
+    };
+
+    FinalAwaiter final_suspend() noexcept { return {}; }
+
+    void unhandled_exception() {
+        if (detached) {
+            std::terminate(); // nobody is going to observe it
+        }
+        exception = std::current_exception();
+    }
+
+protected:
+    template<typename> friend class rpc::Task;
+
+    void rethrow() const {
+        if (exception) {
+            std::rethrow_exception(exception);
+        }
+    }
+
+    std::coroutine_handle<> continuation;
+    std::exception_ptr exception;
+    bool detached = false;
+};
+
+template<typename T>
+class TaskPromise : public TaskPromiseBase {
+public:
+    Task<T> get_return_object() noexcept;
+
+    template<typename Value>
+    void return_value(Value&& value) { result.emplace(std::forward<Value>(value)); }
+
+    T takeResult() {
+        rethrow();
+        return std::move(*result);
+    }
+
+private:
+    std::optional<T> result;
+};
+
+template<>
+class TaskPromise<void> : public TaskPromiseBase {
+public:
+    Task<void> get_return_object() noexcept;
+
+    void return_void() noexcept {}
+
+    void takeResult() { rethrow(); }
+};
+
+template<typename R, std::size_t Capacity>
+class FutureAwaiter {
+public:
+    explicit FutureAwaiter(Future<R, Capacity>&& future) : future(std::move(future)) {}
+
+    bool await_ready() const { return future.ready(); }
+
+    bool await_suspend(std::coroutine_handle<> awaiting) {
+        handle = awaiting;
+        // continuation may run right here if result has just arrived, then do not suspend at all
+        const bool registered = future.then([this](R&& value) {
+            result.emplace(std::move(value));
+            if (suspended.exchange(true, std::memory_order_acq_rel)) {
+                handle.resume();
+            }
+        });
+        return registered && !suspended.exchange(true, std::memory_order_acq_rel);
+    }
+
+    R await_resume() {
+        if (result) {
+            return std::move(*result);
+        }
+        return future.get(); // throws if the call was released
+    }
+
+private:
+    Future<R, Capacity> future;
+    std::optional<R> result;
+    std::coroutine_handle<> handle;
+    std::atomic<bool> suspended{false};
+};
+
+} // namespace detail
+
+/// Lazily started coroutine. `co_await`ing it starts it and resumes the awaiting coroutine
+/// when it finishes, `spawn` starts it detached. Rpc results are awaited through `rpc::Future`:
+///
+/// ```
+/// rpc::Task<int> sumOfSquares(MyInterface& sender, int a, int b) {
+///     co_return co_await sender.square(a) + co_await sender.square(b);
+/// }
+/// ```
+/// Coroutines suspended on Rpc results hold no thread, they are resumed from `onResultReturned`,
+/// i.e. right on the thread dispatching the result
+template<typename T = void>
+class Task {
+public:
+    using promise_type = detail::TaskPromise<T>;
+
+    Task(Task&& other) noexcept : handle(std::exchange(other.handle, nullptr)) {}
+
+    Task& operator = (Task&& other) noexcept {
+        if (this != &other) {
+            reset();
+            handle = std::exchange(other.handle, nullptr);
+        }
+        return *this;
+    }
+
+    ~Task() { reset(); }
+
+    bool done() const { return !handle || handle.done(); }
+
+    auto operator co_await() && noexcept {
+        struct Awaiter {
+            std::coroutine_handle<promise_type> handle;
+
+            bool await_ready() const noexcept { return handle.done(); }
+
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept {
+                handle.promise().continuation = awaiting;
+                return handle;
+            }
+
+            T await_resume() { return handle.promise().takeResult(); }
+        };
+        return Awaiter{handle};
+    }
+
+    /// starts the task, its frame is destroyed when it finishes
+    friend void spawn(Task&& task) { task.startDetached(); }
+
+private:
+    friend promise_type;
+    explicit Task(std::coroutine_handle<promise_type> handle) : handle(handle) {}
+
+    void startDetached() {
+        auto started = std::exchange(handle, nullptr);
+        started.promise().detached = true;
+        started.resume();
+    }
+
+    void reset() {
+        if (handle) {
+            std::exchange(handle, nullptr).destroy();
+        }
+    }
+
+    std::coroutine_handle<promise_type> handle;
+};
+
+namespace detail {
+
+template<typename T>
+Task<T> TaskPromise<T>::get_return_object() noexcept {
+    return Task<T>(std::coroutine_handle<TaskPromise>::from_promise(*this));
+}
+
+inline Task<void> TaskPromise<void>::get_return_object() noexcept {
+    return Task<void>(std::coroutine_handle<TaskPromise>::from_promise(*this));
+}
+
+} // namespace detail
+
+/// makes `rpc::Future` awaitable, the coroutine is suspended until result is returned
+template<typename R, std::size_t Capacity>
+detail::FutureAwaiter<R, Capacity> operator co_await(Future<R, Capacity>&& future) {
+    return detail::FutureAwaiter<R, Capacity>(std::move(future));
+}
+
+} // namespace rpc
@@ -0,0 +1,283 @@
+#pragma once
+#include "rpc.h"
+
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <thread>
+
+namespace rpc {
+
+/// How packets of a single Rpc may be reordered by `Dispatcher`
+enum class Ordering : uint8_t {
+    Unordered,   ///< packets are handled concurrently in any order
+    PerFunction, ///< packets of the Rpc are handled one at a time, in the order they were posted
+    PerKey,      ///< same, but only among packets with the same key
+};
+
+/// Dispatches packets of an interface on a pool of worker threads. Each worker has its own queue
+/// and steals from others when it runs out of work. Ordered packets go through strands: serial
+/// queues picked by hashing FunctionId or key, which run on any worker one packet at a time.
+/// Different keys may share a strand, so they are then ordered as well.
+///
+/// ```
+/// rpc::Dispatcher<MyInterface, Payload> dispatcher(receiver, 8);
+/// dispatcher.setOrdering(receiver.addPhonebook, rpc::Ordering::PerFunction);
+/// dispatcher.orderByKey(receiver.addAccount, [](const rpc::RpcPacket<Payload>& packet) {
+///     return accountIdOf(packet);
+/// });
+///
+/// dispatcher.post(std::move(packet)); // from transport
+/// ```
+/// Ordering is set per Rpc and applies to calls only, results are always unordered.
+/// It should be configured before packets are posted. Handlers of unordered Rpcs should be
+/// thread-safe, so should `onResultReturned`. Handler exceptions go to the error handler if one
+/// is set, otherwise they terminate the program as in any other thread
+template<class Interface, typename Payload>
+class Dispatcher {
+public:
+    using KeyFunction = InplaceFunction<uint64_t(const RpcPacket<Payload>&), 4 * sizeof(void*)>;
+    using ErrorHandler = InplaceFunction<void(const RpcPacket<Payload>&, std::exception_ptr), 4 * sizeof(void*)>;
+
+    static constexpr std::size_t strandCount = 256;
+    /// strand yields its worker after this many packets to let other work run
+    static constexpr std::size_t strandBurst = 32;
+
+    explicit Dispatcher(Interface& interface, std::size_t threadCount = std::thread::hardware_concurrency())
+        : interface(interface), workers(std::max<std::size_t>(threadCount, 1)), strands(new Strand[strandCount]) {
+        threads.reserve(workers.size());
+        for (std::size_t i = 0; i < workers.size(); ++i) {
+            threads.emplace_back([this, i] { run(i); });
+        }
+    }
+
+    Dispatcher(const Dispatcher&) = delete;
+    Dispatcher& operator = (const Dispatcher&) = delete;
+
+    /// handles everything already posted and stops workers
+    ~Dispatcher() {
+        {
+            std::lock_guard<std::mutex> lock(sleepMutex);
+            stopping = true;
+        }
+        wakeUp.notify_all();
+        for (auto& thread : threads) {
+            thread.join();
+        }
+    }
+
+    template<typename Call>
+    void setOrdering(const Call& call, Ordering ordering) {
+        assert(ordering != Ordering::PerKey && "Use orderByKey to set a key");
+        policyFor(call.getFunctionId()).ordering = ordering;
+    }
+
+    /// orders calls of `call` Rpc per key returned by `key(packet)`
+    template<typename Call, typename F>
+    void orderByKey(const Call& call, F&& key) {
+        auto& policy = policyFor(call.getFunctionId());
+        policy.ordering = Ordering::PerKey;
+        policy.key = KeyFunction(std::forward<F>(key));
+    }
+
+    template<typename F>
+    void setErrorHandler(F&& f) {
+        errorHandler = ErrorHandler(std::forward<F>(f));
+    }
+
+    void post(RpcPacket<Payload>&& packet) {
+        outstanding.fetch_add(1, std::memory_order_relaxed);
+        const auto* policy = packet.callType == CallType::Call && packet.functionId < policies.size()
+            ? &policies[packet.functionId] : nullptr;
+        if (!policy || policy->ordering == Ordering::Unordered) {
+            push(Job{std::move(packet), noStrand});
+            return;
+        }
+
+        uint64_t lane = packet.functionId;
+        if (policy->ordering == Ordering::PerKey) {
+            lane = mix(lane ^ mix(policy->key(packet)));
+        }
+        const auto index = uint32_t(mix(lane) % strandCount);
+        auto& strand = strands[index];
+        {
+            std::lock_guard<std::mutex> lock(strand.mutex);
+            strand.packets.push_back(std::move(packet));
+            if (strand.scheduled) {
+                return;
+            }
+            strand.scheduled = true;
+        }
+        push(Job{{}, index});
+    }
+
+    /// blocks until all posted packets are handled
+    void waitIdle() {
+        for (auto count = outstanding.load(std::memory_order_acquire); count != 0; count = outstanding.load(std::memory_order_acquire)) {
+            outstanding.wait(count, std::memory_order_acquire);
+        }
+    }
+
+    std::size_t threadCount() const { return threads.size(); }
+
+private:
+    static constexpr uint32_t noStrand = ~uint32_t(0);
+
+    struct Job {
+        RpcPacket<Payload> packet;
+        uint32_t strand = noStrand;
+    };
+
+    struct alignas(64) Worker {
+        std::mutex mutex;
+        std::deque<Job> jobs;
+    };
+
+    struct alignas(64) Strand {
+        std::mutex mutex;
+        std::deque<RpcPacket<Payload>> packets;
+        bool scheduled = false;
+    };
+
+    struct Policy {
+        Ordering ordering = Ordering::Unordered;
+        KeyFunction key;
+    };
+
+    static uint64_t mix(uint64_t x) {
+        // splitmix64 finalizer
+        x ^= x >> 30;
+        x *= 0xbf58476d1ce4e5b9ull;
+        x ^= x >> 27;
+        x *= 0x94d049bb133111ebull;
+        return x ^ (x >> 31);
+    }
+
+    Policy& policyFor(FunctionId functionId) {
+        if (functionId >= policies.size()) {
+            policies.resize(functionId + 1);
+        }
+        return policies[functionId];
+    }
+
+    static std::size_t& currentWorker() {
+        thread_local std::size_t index = ~std::size_t(0);
+        return index;
+    }
+
+    void push(Job&& job) {
+        // workers keep their own jobs local, other threads spread jobs round-robin
+        std::size_t index = currentWorker();
+        if (index >= workers.size()) {
+            index = nextWorker.fetch_add(1, std::memory_order_relaxed) % workers.size();
+        }
+        {
+            std::lock_guard<std::mutex> lock(workers[index].mutex);
+            workers[index].jobs.push_back(std::move(job));
+        }
+        queued.fetch_add(1);
+        if (sleeping.load() != 0) {
+            std::lock_guard<std::mutex> lock(sleepMutex);
+            wakeUp.notify_one();
+        }
+    }
+
+    bool pop(std::size_t self, Job& job) {
+        for (std::size_t i = 0; i < workers.size(); ++i) {
+            const bool own = i == 0;
+            auto& worker = workers[(self + i) % workers.size()];
+            std::lock_guard<std::mutex> lock(worker.mutex);
+            if (worker.jobs.empty()) {
+                continue;
+            }
+            // own jobs are taken FIFO, stolen ones from the other end
+            if (own) {
+                job = std::move(worker.jobs.front());
+                worker.jobs.pop_front();
+            } else {
+                job = std::move(worker.jobs.back());
+                worker.jobs.pop_back();
+            }
+            queued.fetch_sub(1);
+            return true;
+        }
+        return false;
+    }
+
+    void run(std::size_t self) {
+        currentWorker() = self;
+        Job job;
+        while (true) {
+            if (pop(self, job)) {
+                if (job.strand == noStrand) {
+                    handle(std::move(job.packet));
+                } else {
+                    runStrand(job.strand);
+                }
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(sleepMutex);
+            sleeping.fetch_add(1);
+            wakeUp.wait(lock, [this] { return queued.load() != 0 || stopping; });
+            sleeping.fetch_sub(1);
+            if (stopping && queued.load() == 0) {
+                return;
+            }
+        }
+    }
+
+    void runStrand(uint32_t index) {
+        auto& strand = strands[index];
+        for (std::size_t handled = 0;; ++handled) {
+            RpcPacket<Payload> packet;
+            {
+                std::lock_guard<std::mutex> lock(strand.mutex);
+                if (strand.packets.empty()) {
+                    strand.scheduled = false;
+                    return;
+                }
+                if (handled == strandBurst) {
+                    break; // still scheduled, requeued below
+                }
+                packet = std::move(strand.packets.front());
+                strand.packets.pop_front();
+            }
+            handle(std::move(packet));
+        }
+        push(Job{{}, index});
+    }
+
+    void handle(RpcPacket<Payload>&& packet) {
+        if (errorHandler) {
+            try {
+                interface.dispatch(packet);
+            } catch (...) {
+                errorHandler(packet, std::current_exception());
+            }
+        } else {
+            interface.dispatch(packet);
+        }
+        Interface::releasePacket(std::move(packet));
+        if (outstanding.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            outstanding.notify_all();
+        }
+    }
+
+    Interface& interface;
+    std::vector<Worker> workers;
+    std::unique_ptr<Strand[]> strands;
+    std::vector<Policy> policies;
+    ErrorHandler errorHandler;
+
+    std::atomic<std::size_t> nextWorker{0};
+    std::atomic<std::size_t> queued{0};
+    std::atomic<std::size_t> outstanding{0};
+    std::atomic<std::size_t> sleeping{0};
+    std::mutex sleepMutex;
+    std::condition_variable wakeUp;
+    bool stopping = false;
+    std::vector<std::thread> threads;
+};
+
+} // namespace rpc
@@ -0,0 +1,138 @@
+#pragma once
+#include "rpc_pending_calls.h"
+
+#include <memory>
+#include <stdexcept>
+#include <vector>
+
+namespace rpc {
+
+/// Lightweight future for Rpc results. Its shared state is a slot of `ResultSlots`,
+/// so creating and completing it does not allocate and involves no mutex.
+/// Return it from `sendRpcPacket<R>` to make Rpc calls return it:
+///
+/// ```
+/// rpc::PendingResults<rpc::defaultPendingCapacity, int> results;
+///
+/// template<typename R>
+/// auto sendRpcPacket(rpc::RpcPacket<Payload>&& packet) {
+///     if constexpr (!std::is_same_v<void, R>) {
+///         if (packet.callType != rpc::CallType::Call) { send(std::move(packet)); return rpc::Future<R>(); }
+///         auto& slots = results.slots<R>();
+///         packet.callId = *slots.acquire();
+///         rpc::Future<R> future(slots, packet.callId);
+///         send(std::move(packet));
+///         return future;
+///     } else { send(std::move(packet)); }
+/// }
+///
+/// template<typename R>
+/// void onResultReturned(uint32_t callId, const R& result) {
+///     results.slots<R>().complete(callId, result);
+/// }
+/// ```
+/// Destroying a future without getting its result releases the slot
+template<typename R, std::size_t Capacity = defaultPendingCapacity>
+class Future {
+public:
+    Future() = default;
+    Future(ResultSlots<R, Capacity>& slots, CallId callId) : slots(&slots), callId(callId) {}
+
+    Future(Future&& other) noexcept : slots(std::exchange(other.slots, nullptr)), callId(other.callId) {}
+
+    Future& operator = (Future&& other) noexcept {
+        if (this != &other) {
+            reset();
+            slots = std::exchange(other.slots, nullptr);
+            callId = other.callId;
+        }
+        return *this;
+    }
+
+    ~Future() { reset(); }
+
+    bool valid() const { return slots != nullptr; }
+    CallId getCallId() const { return callId; }
+
+    bool ready() const { return slots && slots->ready(callId); }
+
+    /// spins for a while, then parks the thread until result is returned
+    void wait() const {
+        if (slots) {
+            slots->wait(callId);
+        }
+    }
+
+    /// waits for result and takes it, throws if the call was released or the future is not valid
+    R get() {
+        wait();
+        auto result = slots ? slots->take(callId) : std::nullopt;
+        slots = nullptr;
+        if (!result) {
+            throw std::logic_error("rpc::Future has no result");
+        }
+        return std::move(*result);
+    }
+
+    /// Calls `f(R&&)` inline when result is returned, right away if it is already here.
+    /// Future is not valid after this call
+    template<typename F>
+    bool then(F&& f) {
+        auto* table = std::exchange(slots, nullptr);
+        return table && table->then(callId, std::forward<F>(f));
+    }
+
+private:
+    void reset() {
+        if (slots) {
+            std::exchange(slots, nullptr)->release(callId);
+        }
+    }
+
+    ResultSlots<R, Capacity>* slots = nullptr;
+    CallId callId = 0;
+};
+
+/// Calls `f(std::vector<R>&&)` once all `futures` have their results, with results in the same order.
+/// It runs inline on the thread completing the last call. Released calls never complete
+template<typename R, std::size_t Capacity, typename F>
+void whenAll(std::vector<Future<R, Capacity>>&& futures, F&& f) {
+    struct State {
+        State(std::size_t count, F&& f) : results(count), remaining(count), callback(std::forward<F>(f)) {}
+
+        std::vector<std::optional<R>> results;
+        std::atomic<std::size_t> remaining;
+        std::decay_t<F> callback;
+    };
+    auto state = std::make_shared<State>(futures.size(), std::forward<F>(f));
+    if (futures.empty()) {
+        state->callback(std::vector<R>{});
+        return;
+    }
+    for (std::size_t i = 0; i < futures.size(); ++i) {
+        futures[i].then([state, i](R&& result) {
+            state->results[i] = std::move(result);
+            if (state->remaining.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+                std::vector<R> results;
+                results.reserve(state->results.size());
+                for (auto& r : state->results) {
+                    results.push_back(std::move(*r));
+                }
+                state->callback(std::move(results));
+            }
+        });
+    }
+}
+
+/// waits for all `futures` and returns their results in the same order
+template<typename R, std::size_t Capacity>
+std::vector<R> waitAll(std::span<Future<R, Capacity>> futures) {
+    std::vector<R> results;
+    results.reserve(futures.size());
+    for (auto& future : futures) {
+        results.push_back(future.get());
+    }
+    return results;
+}
+
+} // namespace rpc
@@ -0,0 +1,341 @@
+#pragma once
+#include "rpc.h"
+
+#include <string>
+#include <system_error>
+#include <thread>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace rpc {
+
+namespace recording {
+
+/// Start of a packet log file. All fields are little-endian
+struct FileHeader {
+    static constexpr uint32_t expectedMagic = 0x4c435052; // "RPCL"
+    static constexpr uint32_t currentVersion = 1;
+
+    uint32_t magic;
+    uint32_t version;
+    uint64_t reserved;
+};
+static_assert(sizeof(FileHeader) == 16);
+
+/// Record of a packet, followed by `payloadSize` payload bytes and padding up to 8 bytes.
+/// The packet header is a full `rpc::wire` one, `time` counts nanoseconds since the recorder was created
+struct RecordHeader {
+    uint32_t payloadSize;
+    uint32_t deadline; // see `wire::packDeadline`
+    uint64_t time;
+    std::byte packet[wire::headerSize];
+
+    static constexpr std::size_t recordSize(std::size_t payloadSize) {
+        return (sizeof(RecordHeader) + payloadSize + 7) & ~std::size_t(7);
+    }
+};
+static_assert(sizeof(RecordHeader) == 24);
+
+[[noreturn]] inline void throwError(const std::string& what) {
+    throw std::system_error(errno, std::generic_category(), what);
+}
+
+} // namespace recording
+
+/// Appends packets to a log file for `PacketReplayer`, e.g. packets received by a production
+/// receiver right before they are dispatched:
+///
+/// ```
+/// rpc::PacketRecorder recorder("traffic.rpclog");
+/// recorder.record(packet);
+/// receiver.dispatch(packet);
+/// ```
+/// Records are collected in memory and appended with a single write once `bufferSize` bytes are
+/// queued, on `flush` and on destruction. A crash may leave a partial record at the end, the replayer
+/// stops before it. Thread-safe. `Payload` should provide `bytes()`, as `BinaryPayload` does
+class PacketRecorder {
+public:
+    static constexpr std::size_t bufferSize = 1 << 16;
+
+    /// appends to an existing log, throws `std::system_error` if the file can't be opened
+    explicit PacketRecorder(const std::string& path) : start(std::chrono::steady_clock::now()) {
+        fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            recording::throwError("open " + path);
+        }
+        struct stat info;
+        if (::fstat(fd, &info) != 0) {
+            const int error = errno;
+            ::close(fd);
+            throw std::system_error(error, std::generic_category(), "fstat " + path);
+        }
+        if (info.st_size == 0) {
+            recording::FileHeader header{wire::toLittleEndian(recording::FileHeader::expectedMagic),
+                                   wire::toLittleEndian(recording::FileHeader::currentVersion), 0};
+            append(&header, sizeof(header));
+        }
+        buffer.reserve(bufferSize);
+    }
+
+    PacketRecorder(const PacketRecorder&) = delete;
+    PacketRecorder& operator = (const PacketRecorder&) = delete;
+
+    ~PacketRecorder() {
+        try {
+            flush();
+        } catch (const std::system_error&) {
+            // nothing to do about it here, records are lost
+        }
+        ::close(fd);
+    }
+
+    template<typename Payload>
+    void record(const RpcPacket<Payload>& packet) {
+        const auto now = std::chrono::steady_clock::now();
+        const auto payload = packet.payload.bytes();
+        recording::RecordHeader header{};
+        header.payloadSize = wire::toLittleEndian(uint32_t(payload.size()));
+        header.deadline = wire::toLittleEndian(wire::packDeadline(packet.deadline, now));
+        header.time = wire::toLittleEndian(uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(now - start).count()));
+        wire::writeHeader(packet, header.packet);
+
+        std::lock_guard<std::mutex> lock(mutex);
+        const std::size_t offset = buffer.size();
+        buffer.resize(offset + recording::RecordHeader::recordSize(payload.size()));
+        std::memcpy(buffer.data() + offset, &header, sizeof(header));
+        if (!payload.empty()) {
+            std::memcpy(buffer.data() + offset + sizeof(header), payload.data(), payload.size());
+        }
+        std::memset(buffer.data() + offset + sizeof(header) + payload.size(), 0,
+                    buffer.size() - offset - sizeof(header) - payload.size());
+        if (buffer.size() >= bufferSize) {
+            writeBuffer();
+        }
+    }
+
+    /// writes buffered records to the file
+    void flush() {
+        std::lock_guard<std::mutex> lock(mutex);
+        writeBuffer();
+    }
+
+private:
+    void writeBuffer() {
+        append(buffer.data(), buffer.size());
+        buffer.clear();
+    }
+
+    void append(const void* data, std::size_t size) {
+        const auto* bytes = static_cast<const char*>(data);
+        while (size != 0) {
+            const ssize_t written = ::write(fd, bytes, size);
+            if (written < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                recording::throwError("write");
+            }
+            bytes += written;
+            size -= std::size_t(written);
+        }
+    }
+
+    int fd = -1;
+    const std::chrono::steady_clock::time_point start;
+    std::mutex mutex;
+    std::vector<std::byte> buffer;
+};
+
+enum class ReplayMode : uint8_t {
+    FlatOut,    ///< dispatches packets as fast as the receiver takes them
+    AsRecorded, ///< keeps recorded gaps between packets, scaled by `ReplayOptions::speed`
+};
+
+struct ReplayOptions {
+    ReplayMode mode = ReplayMode::FlatOut;
+    /// with `AsRecorded`, 2 replays twice as fast as recorded
+    double speed = 1.0;
+    /// packets passed to a single `dispatchBatch`, 1 uses `dispatch`. Packets are batched only
+    /// as long as they are due
+    std::size_t batchSize = 64;
+};
+
+struct ReplayStats {
+    std::size_t packets = 0;
+    std::size_t payloadBytes = 0;
+    std::size_t skipped = 0; ///< records with invalid packet headers
+    std::chrono::nanoseconds elapsed{0};
+};
+
+/// Replays a packet log written by `PacketRecorder` against a receiver, anything with `dispatch` and
+/// `dispatchBatch` taking `RpcPacket<Payload>`, e.g. an `RpcInterface` or `InstanceRouter`:
+///
+/// ```
+/// rpc::PacketReplayer<Payload> replayer("traffic.rpclog");
+/// auto stats = replayer.replay(receiver, {.mode = rpc::ReplayMode::FlatOut, .batchSize = 64});
+/// std::cout << stats.packets * 1e9 / stats.elapsed.count() << " packets/s\n";
+/// ```
+/// The log is mapped into memory and read in place. Payloads with `borrow(std::span<const std::byte>)`,
+/// as `BinaryPayload` and uncompressed `CompressedPayload`s, refer to mapped bytes, so nothing is copied;
+/// others `assign` them into packets reused for the whole replay. Deadlines are restored relative to
+/// the time a packet is dispatched
+template<typename Payload>
+class PacketReplayer {
+public:
+    /// throws `std::system_error` if the file can't be mapped or is not a packet log
+    explicit PacketReplayer(const std::string& path) {
+        const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            recording::throwError("open " + path);
+        }
+        struct stat info;
+        if (::fstat(fd, &info) != 0) {
+            const int error = errno;
+            ::close(fd);
+            throw std::system_error(error, std::generic_category(), "fstat " + path);
+        }
+        size = std::size_t(info.st_size);
+        if (size >= sizeof(recording::FileHeader)) {
+            data = static_cast<const std::byte*>(::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0));
+        }
+        ::close(fd);
+        if (data == MAP_FAILED || data == nullptr) {
+            data = nullptr;
+            throw std::system_error(size < sizeof(recording::FileHeader) ? EINVAL : errno, std::generic_category(), "mmap " + path);
+        }
+        ::madvise(const_cast<std::byte*>(data), size, MADV_SEQUENTIAL);
+
+        recording::FileHeader header;
+        std::memcpy(&header, data, sizeof(header));
+        if (wire::toLittleEndian(header.magic) != recording::FileHeader::expectedMagic
+            || wire::toLittleEndian(header.version) != recording::FileHeader::currentVersion) {
+            ::munmap(const_cast<std::byte*>(data), size);
+            data = nullptr;
+            throw std::system_error(EINVAL, std::generic_category(), "packet log " + path);
+        }
+    }
+
+    PacketReplayer(const PacketReplayer&) = delete;
+    PacketReplayer& operator = (const PacketReplayer&) = delete;
+
+    ~PacketReplayer() {
+        if (data) {
+            ::munmap(const_cast<std::byte*>(data), size);
+        }
+    }
+
+    /// Calls `f(const RpcPacket<Payload>&, std::chrono::nanoseconds time)` for every packet of the log.
+    /// Packets are valid only during the call
+    template<typename F>
+    ReplayStats forEach(F&& f) {
+        ReplayStats stats;
+        RpcPacket<Payload> packet;
+        for (std::size_t offset = sizeof(recording::FileHeader); const auto* header = recordAt(offset);
+             offset += recording::RecordHeader::recordSize(payloadSize(*header))) {
+            if (!load(*header, packet)) {
+                ++stats.skipped;
+                continue;
+            }
+            ++stats.packets;
+            stats.payloadBytes += payloadSize(*header);
+            f(std::as_const(packet), recordTime(*header));
+        }
+        return stats;
+    }
+
+    template<class Receiver>
+    ReplayStats replay(Receiver& receiver, const ReplayOptions& options = {}) {
+        assert(options.speed > 0);
+        const std::size_t batchSize = std::max<std::size_t>(options.batchSize, 1);
+        std::vector<RpcPacket<Payload>> batch(batchSize);
+        std::size_t queued = 0;
+
+        ReplayStats stats;
+        const auto start = std::chrono::steady_clock::now();
+        // the first packet is due right away
+        const auto* first = recordAt(sizeof(recording::FileHeader));
+        const auto firstTime = first ? recordTime(*first) : std::chrono::nanoseconds(0);
+        auto dueTime = [&](const recording::RecordHeader& header) {
+            const auto time = std::chrono::duration<double, std::nano>(double((recordTime(header) - firstTime).count()) / options.speed);
+            return start + std::chrono::duration_cast<std::chrono::nanoseconds>(time);
+        };
+        auto dispatchQueued = [&] {
+            if (queued == 1) {
+                receiver.dispatch(batch[0]);
+            } else if (queued != 0) {
+                receiver.dispatchBatch(std::span<const RpcPacket<Payload>>(batch.data(), queued));
+            }
+            stats.packets += queued;
+            queued = 0;
+        };
+
+        auto now = start;
+        for (std::size_t offset = sizeof(recording::FileHeader); const auto* header = recordAt(offset);
+             offset += recording::RecordHeader::recordSize(payloadSize(*header))) {
+            if (options.mode == ReplayMode::AsRecorded) {
+                const auto due = dueTime(*header);
+                if (due > now) {
+                    now = std::chrono::steady_clock::now();
+                }
+                if (due > now) {
+                    // packets due so far go first, then wait for this one
+                    dispatchQueued();
+                    std::this_thread::sleep_until(due);
+                    now = std::chrono::steady_clock::now();
+                }
+            }
+            if (!load(*header, batch[queued])) {
+                ++stats.skipped;
+                continue;
+            }
+            stats.payloadBytes += payloadSize(*header);
+            if (++queued == batchSize) {
+                dispatchQueued();
+            }
+        }
+        dispatchQueued();
+        stats.elapsed = std::chrono::steady_clock::now() - start;
+        return stats;
+    }
+
+private:
+    static std::size_t payloadSize(const recording::RecordHeader& header) {
+        return wire::toLittleEndian(header.payloadSize);
+    }
+
+    static std::chrono::nanoseconds recordTime(const recording::RecordHeader& header) {
+        return std::chrono::nanoseconds(int64_t(wire::toLittleEndian(header.time)));
+    }
+
+    /// null at the end of the log or before a partially written record
+    const recording::RecordHeader* recordAt(std::size_t offset) const {
+        if (offset > size || size - offset < sizeof(recording::RecordHeader)) {
+            return nullptr;
+        }
+        const auto* header = reinterpret_cast<const recording::RecordHeader*>(data + offset);
+        return size - offset - sizeof(recording::RecordHeader) >= payloadSize(*header) ? header : nullptr;
+    }
+
+    static bool load(const recording::RecordHeader& header, RpcPacket<Payload>& packet) {
+        if (!wire::readHeader(header.packet, packet)) {
+            return false;
+        }
+        const uint32_t deadline = wire::toLittleEndian(header.deadline);
+        packet.deadline = deadline != 0 ? wire::unpackDeadline(deadline, std::chrono::steady_clock::now()) : noDeadline;
+        const std::span<const std::byte> payload(reinterpret_cast<const std::byte*>(&header + 1), payloadSize(header));
+        if constexpr (requires { packet.payload.borrow(payload); }) {
+            packet.payload.borrow(payload);
+        } else {
+            packet.payload.assign(payload);
+        }
+        return true;
+    }
+
+    const std::byte* data = nullptr;
+    std::size_t size = 0;
+};
+
+} // namespace rpc
@@ -0,0 +1,521 @@
+#pragma once
+#include "rpc.h"
+
+#include <atomic>
+#include <bit>
+#include <mutex>
+#include <optional>
+#include <vector>
+
+namespace rpc {
+
+/// Lock-free table of values for outstanding calls (e.g. promises), safe to use from many threads.
+/// Slot is found directly by `CallId` low bits and the full id is checked on lookup, so with sequential
+/// call ids there are no collisions unless more than `Capacity` calls are outstanding.
+/// `Capacity` should be a power of two
+template<typename T, std::size_t Capacity>
+class PendingCalls {
+    static_assert(Capacity != 0 && (Capacity & (Capacity - 1)) == 0, "Capacity should be a power of two");
+
+public:
+    PendingCalls() = default;
+    PendingCalls(const PendingCalls&) = delete;
+    PendingCalls& operator = (const PendingCalls&) = delete;
+
+    ~PendingCalls() {
+        for (auto& slot : slots) {
+            if (slot.state.load(std::memory_order_relaxed) == Full) {
+                slot.value()->~T();
+            }
+        }
+    }
+
+    /// returns false if the slot is still taken by a call `Capacity` ids older
+    bool insert(CallId callId, T value) {
+        auto& slot = slots[callId & (Capacity - 1)];
+        uint8_t expected = Empty;
+        if (!slot.state.compare_exchange_strong(expected, Busy, std::memory_order_acquire)) {
+            return false;
+        }
+        ::new (static_cast<void*>(slot.storage)) T(std::move(value));
+        slot.callId.store(callId, std::memory_order_relaxed);
+        slot.state.store(Full, std::memory_order_release);
+        return true;
+    }
+
+    /// removes and returns value for `callId`, if any
+    std::optional<T> take(CallId callId) {
+        auto& slot = slots[callId & (Capacity - 1)];
+        uint8_t expected = Full;
+        if (slot.state.load(std::memory_order_acquire) != Full
+            || slot.callId.load(std::memory_order_relaxed) != callId
+            || !slot.state.compare_exchange_strong(expected, Busy, std::memory_order_acquire)) {
+            return std::nullopt;
+        }
+        if (slot.callId.load(std::memory_order_relaxed) != callId) {
+            // slot was reused between the check and the exchange
+            slot.state.store(Full, std::memory_order_release);
+            return std::nullopt;
+        }
+        std::optional<T> result(std::move(*slot.value()));
+        slot.value()->~T();
+        slot.state.store(Empty, std::memory_order_release);
+        return result;
+    }
+
+private:
+    enum State : uint8_t {
+        Empty,
+        Busy,
+        Full
+    };
+
+    // each slot on its own cache line, so threads completing different calls don't interfere
+    struct alignas(64) Slot {
+        std::atomic<uint8_t> state{Empty};
+        std::atomic<CallId> callId{0};
+        alignas(T) unsigned char storage[sizeof(T)];
+
+        T* value() { return std::launder(reinterpret_cast<T*>(storage)); }
+    };
+
+    Slot slots[Capacity];
+};
+
+/// default capacity of result tables, also the one `rpc::Future` expects
+inline constexpr std::size_t defaultPendingCapacity = 1024;
+
+/// Fixed-capacity table of typed results for outstanding calls. Unlike `PendingCalls` slots are allocated
+/// by the table itself: low bits of a `CallId` it returns are the slot index, high bits are a slot
+/// generation, so completing or taking a result is a direct array access, and stale or foreign ids are
+/// rejected by the generation check. Results are stored in place, nothing is allocated.
+/// All operations are lock-free. `Capacity` should be a power of two
+template<typename R, std::size_t Capacity = defaultPendingCapacity>
+class ResultSlots {
+    static_assert(Capacity != 0 && (Capacity & (Capacity - 1)) == 0, "Capacity should be a power of two");
+    static_assert(Capacity <= (std::size_t(1) << 24), "Too few bits left for slot generation");
+
+public:
+    ResultSlots() {
+        for (uint32_t i = 0; i < Capacity; ++i) {
+            nextFree[i].store(i + 1 < Capacity ? i + 1 : noSlot, std::memory_order_relaxed);
+        }
+        freeHead.store(0, std::memory_order_relaxed);
+    }
+
+    ResultSlots(const ResultSlots&) = delete;
+    ResultSlots& operator = (const ResultSlots&) = delete;
+
+    ~ResultSlots() {
+        for (auto& slot : slots) {
+            if (slot.state.load(std::memory_order_relaxed) == Ready) {
+                slot.result()->~R();
+            }
+        }
+    }
+
+    /// allocates a slot for a new call, returns its `CallId` or nothing if all slots are busy
+    std::optional<CallId> acquire() {
+        const auto index = popFree();
+        if (index == noSlot) {
+            return std::nullopt;
+        }
+        auto& slot = slots[index];
+        CallId generation = (slot.callId.load(std::memory_order_relaxed) >> indexBits) + 1;
+        CallId callId = (generation << indexBits) | index;
+        if (callId == 0) {
+            callId = CallId(1) << indexBits; // zero id is never issued
+        }
+        slot.callId.store(callId, std::memory_order_relaxed);
+        slot.state.store(Waiting, std::memory_order_release);
+        return callId;
+    }
+
+    /// Stores result, fails for unknown, already completed or released calls. Waits while another
+    /// thread holds the slot, e.g. installs a continuation with `then`
+    template<typename Result>
+    bool complete(CallId callId, Result&& result) {
+        auto* slot = find(callId);
+        if (!slot) {
+            return false;
+        }
+        while (true) {
+            uint8_t state = slot->state.load(std::memory_order_acquire);
+            if (slot->callId.load(std::memory_order_relaxed) != callId || (state != Waiting && state != Writing)) {
+                return false;
+            }
+            if (state == Writing || !slot->state.compare_exchange_weak(state, Writing, std::memory_order_acquire)) {
+                cpuRelax();
+                continue;
+            }
+            if (slot->callId.load(std::memory_order_relaxed) != callId) {
+                // slot was released and reused between the check and the exchange
+                slot->state.store(Waiting, std::memory_order_release);
+                return false;
+            }
+            break;
+        }
+        if (slot->continuation) {
+            // result goes straight to the continuation on this thread, it is never stored
+            auto continuation = std::move(slot->continuation);
+            freeSlot(*slot, callId);
+            continuation(R(std::forward<Result>(result)));
+            return true;
+        }
+        ::new (static_cast<void*>(slot->storage)) R(std::forward<Result>(result));
+        slot->state.store(Ready, std::memory_order_release);
+        slot->state.notify_all();
+        return true;
+    }
+
+    /// Registers `f(R&&)` to be called with the result. It is called inline from `complete`, usually on
+    /// a dispatching thread, or right away if the result is already here. The result is not stored then.
+    /// Returns false for unknown or released calls
+    template<typename F>
+    bool then(CallId callId, F&& f) {
+        auto* slot = find(callId);
+        if (!slot) {
+            return false;
+        }
+        while (true) {
+            uint8_t state = slot->state.load(std::memory_order_acquire);
+            if (slot->callId.load(std::memory_order_relaxed) != callId || state == Free) {
+                return false;
+            }
+            if (state == Writing || !slot->state.compare_exchange_weak(state, Writing, std::memory_order_acquire)) {
+                continue;
+            }
+            if (slot->callId.load(std::memory_order_relaxed) != callId) {
+                slot->state.store(state, std::memory_order_release);
+                return false;
+            }
+            if (state == Waiting) {
+                slot->continuation = Continuation(std::forward<F>(f));
+                slot->state.store(Waiting, std::memory_order_release);
+            } else {
+                R result(std::move(*slot->result()));
+                slot->result()->~R();
+                freeSlot(*slot, callId);
+                std::forward<F>(f)(std::move(result));
+            }
+            return true;
+        }
+    }
+
+    /// Blocks until result is returned or the call is released. Spins for a while first,
+    /// as results of fast calls usually come soon, then parks the thread
+    void wait(CallId callId) const {
+        auto* slot = find(callId);
+        for (int i = 0; slot && i < spinCount; ++i) {
+            if (slot->state.load(std::memory_order_acquire) != Waiting) {
+                break;
+            }
+            cpuRelax();
+        }
+        while (slot && slot->callId.load(std::memory_order_relaxed) == callId) {
+            const uint8_t state = slot->state.load(std::memory_order_acquire);
+            if (state == Ready || state == Free) {
+                return;
+            }
+            slot->state.wait(state, std::memory_order_acquire);
+        }
+    }
+
+    bool ready(CallId callId) const {
+        auto* slot = find(callId);
+        return slot && slot->state.load(std::memory_order_acquire) == Ready
+            && slot->callId.load(std::memory_order_relaxed) == callId;
+    }
+
+    /// moves result out and frees the slot if the result is ready
+    std::optional<R> take(CallId callId) {
+        auto* slot = find(callId);
+        uint8_t expected = Ready;
+        if (!slot || slot->callId.load(std::memory_order_relaxed) != callId
+            || !slot->state.compare_exchange_strong(expected, Writing, std::memory_order_acquire)) {
+            return std::nullopt;
+        }
+        if (slot->callId.load(std::memory_order_relaxed) != callId) {
+            slot->state.store(Ready, std::memory_order_release);
+            return std::nullopt;
+        }
+        std::optional<R> result(std::move(*slot->result()));
+        slot->result()->~R();
+        freeSlot(*slot, callId);
+        return result;
+    }
+
+    /// abandons a call, its result is dropped whether it is already returned or not
+    void release(CallId callId) {
+        auto* slot = find(callId);
+        if (!slot) {
+            return;
+        }
+        while (true) {
+            uint8_t state = slot->state.load(std::memory_order_acquire);
+            if (slot->callId.load(std::memory_order_relaxed) != callId || state == Free) {
+                return;
+            }
+            if (state == Writing) {
+                continue; // result is being stored right now
+            }
+            if (slot->state.compare_exchange_weak(state, Writing, std::memory_order_acquire)) {
+                if (slot->callId.load(std::memory_order_relaxed) != callId) {
+                    slot->state.store(state, std::memory_order_release);
+                    return;
+                }
+                if (state == Ready) {
+                    slot->result()->~R();
+                }
+                slot->continuation = {};
+                freeSlot(*slot, callId);
+                return;
+            }
+        }
+    }
+
+    /// continuations are stored inline in slots
+    static constexpr std::size_t continuationCapacity = 4 * sizeof(void*);
+    using Continuation = InplaceFunction<void(R&&), continuationCapacity>;
+
+private:
+    static constexpr uint32_t noSlot = ~uint32_t(0);
+    static constexpr int spinCount = 1000;
+    static constexpr CallId indexBits = std::countr_zero(Capacity);
+
+    enum State : uint8_t {
+        Free,
+        Waiting,
+        Writing, // exclusively owned by a thread storing or taking result
+        Ready
+    };
+
+    struct alignas(64) Slot {
+        std::atomic<uint8_t> state{Free};
+        std::atomic<CallId> callId{0};
+        Continuation continuation;
+        alignas(R) unsigned char storage[sizeof(R)];
+
+        R* result() { return std::launder(reinterpret_cast<R*>(storage)); }
+    };
+
+    Slot* find(CallId callId) {
+        auto& slot = slots[callId & (Capacity - 1)];
+        return slot.callId.load(std::memory_order_acquire) == callId ? &slot : nullptr;
+    }
+
+    Slot* find(CallId callId) const {
+        return const_cast<ResultSlots*>(this)->find(callId);
+    }
+
+    void freeSlot(Slot& slot, CallId callId) {
+        slot.state.store(Free, std::memory_order_release);
+        slot.state.notify_all();
+        pushFree(uint32_t(callId & (Capacity - 1)));
+    }
+
+    // Treiber stack of free slot indices, head is tagged with a counter against ABA
+    uint32_t popFree() {
+        uint64_t head = freeHead.load(std::memory_order_acquire);
+        while (true) {
+            const auto index = uint32_t(head);
+            if (index == noSlot) {
+                return noSlot;
+            }
+            const uint64_t next = ((head & ~uint64_t(noSlot)) + (uint64_t(1) << 32)) | nextFree[index].load(std::memory_order_relaxed);
+            if (freeHead.compare_exchange_weak(head, next, std::memory_order_acquire, std::memory_order_acquire)) {
+                return index;
+            }
+        }
+    }
+
+    void pushFree(uint32_t index) {
+        uint64_t head = freeHead.load(std::memory_order_relaxed);
+        while (true) {
+            nextFree[index].store(uint32_t(head), std::memory_order_relaxed);
+            const uint64_t next = ((head & ~uint64_t(noSlot)) + (uint64_t(1) << 32)) | index;
+            if (freeHead.compare_exchange_weak(head, next, std::memory_order_release, std::memory_order_relaxed)) {
+                return;
+            }
+        }
+    }
+
+    Slot slots[Capacity];
+    std::atomic<uint32_t> nextFree[Capacity];
+    alignas(64) std::atomic<uint64_t> freeHead{0};
+};
+
+/// Hashed timer wheel expiring outstanding calls of a `ResultSlots` table by their deadlines, so that
+/// calls whose results never come don't hold their slots forever:
+///
+/// ```
+/// rpc::DeadlineReaper<int> reaper(results.slots<int>());
+///
+/// reaper.schedule(packet.callId, packet.deadline);                    // in sendRpcPacket<R>, after `acquire`
+/// reaper.cancel(callId);                                               // in onResultReturned<R>, before `complete`
+/// reaper.reap(std::chrono::steady_clock::now(), [&](rpc::CallId callId) { // periodically
+///     caller.square.cancel(callId);                                    // its slot is already released
+/// });
+/// ```
+/// A reaper belongs to one table, as ids of different tables repeat: with `PendingResults` use one
+/// per result type. Calls are kept in a node per slot of the table, linked into one of `WheelSize`
+/// buckets of a `tick` each. The table issues a slot again only after it is freed, so a node still
+/// scheduled for an older id of the slot is stale and is simply replaced. Scheduling and cancelling
+/// are O(1), `reap` visits only buckets of the ticks passed since the previous one and releases expired
+/// calls from the table, their futures wake up with no result. Calls expire at most a tick late.
+/// All operations take a mutex, `release` and `expire` are called without it
+template<typename R, std::size_t Capacity = defaultPendingCapacity, std::size_t WheelSize = 256>
+class DeadlineReaper {
+    static_assert(WheelSize != 0);
+
+public:
+    explicit DeadlineReaper(ResultSlots<R, Capacity>& slots, std::chrono::nanoseconds tick = std::chrono::milliseconds(1),
+                            Deadline start = std::chrono::steady_clock::now())
+        : slots(slots), tick(std::max<std::chrono::nanoseconds>(tick, std::chrono::nanoseconds(1))), start(start) {
+        std::fill(std::begin(buckets), std::end(buckets), noNode);
+    }
+
+    DeadlineReaper(const DeadlineReaper&) = delete;
+    DeadlineReaper& operator = (const DeadlineReaper&) = delete;
+
+    /// tracks call `callId` issued by the table, returns false only for calls without a deadline
+    bool schedule(CallId callId, Deadline deadline) {
+        if (deadline == noDeadline) {
+            return false;
+        }
+        const auto index = uint32_t(callId & (Capacity - 1));
+        std::lock_guard<std::mutex> lock(mutex);
+        auto& node = nodes[index];
+        if (node.linked) {
+            unlink(index); // an older call of this slot, already freed
+        }
+        // deadlines already passed go to the next reaped tick
+        node.callId = callId;
+        node.tick = std::max(ceilTick(deadline), reapedTick + 1);
+        link(index);
+        return true;
+    }
+
+    /// forgets call `callId`, returns false if it is not scheduled or has already expired
+    bool cancel(CallId callId) {
+        const auto index = uint32_t(callId & (Capacity - 1));
+        std::lock_guard<std::mutex> lock(mutex);
+        auto& node = nodes[index];
+        if (!node.linked || node.callId != callId) {
+            return false;
+        }
+        unlink(index);
+        return true;
+    }
+
+    /// Releases every call with a deadline up to `now` from the table and calls `expire(CallId)`
+    /// for it, returns how many expired
+    template<typename F>
+    std::size_t reap(Deadline now, F&& expire) {
+        std::lock_guard<std::mutex> reapLock(reapMutex);
+        expired.clear();
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            const int64_t nowTick = (now - start) / tick;
+            // a full turn of the wheel visits every bucket, later ticks would visit them again
+            const int64_t last = std::min(nowTick, reapedTick + int64_t(WheelSize));
+            for (int64_t t = reapedTick + 1; t <= last; ++t) {
+                for (uint32_t index = buckets[bucketOf(t)]; index != noNode;) {
+                    const uint32_t next = nodes[index].next;
+                    if (nodes[index].tick <= nowTick) {
+                        expired.push_back(nodes[index].callId);
+                        unlink(index);
+                    }
+                    index = next;
+                }
+            }
+            reapedTick = std::max(reapedTick, nowTick);
+        }
+        for (const CallId callId : expired) {
+            slots.release(callId);
+            expire(callId);
+        }
+        return expired.size();
+    }
+
+    std::size_t reap(Deadline now) {
+        return reap(now, [](CallId) {});
+    }
+
+private:
+    static constexpr uint32_t noNode = ~uint32_t(0);
+
+    struct Node {
+        CallId callId = 0;
+        bool linked = false;
+        uint32_t previous = noNode;
+        uint32_t next = noNode;
+        int64_t tick = 0;
+    };
+
+    int64_t ceilTick(Deadline deadline) const {
+        const auto offset = deadline - start;
+        return offset <= Deadline::duration::zero() ? 0 : (offset + tick - std::chrono::nanoseconds(1)) / tick;
+    }
+
+    static std::size_t bucketOf(int64_t tick) { return std::size_t(tick) % WheelSize; }
+
+    void link(uint32_t index) {
+        auto& node = nodes[index];
+        auto& head = buckets[bucketOf(node.tick)];
+        node.previous = noNode;
+        node.next = head;
+        if (head != noNode) {
+            nodes[head].previous = index;
+        }
+        head = index;
+        node.linked = true;
+    }
+
+    void unlink(uint32_t index) {
+        auto& node = nodes[index];
+        if (node.previous != noNode) {
+            nodes[node.previous].next = node.next;
+        } else {
+            buckets[bucketOf(node.tick)] = node.next;
+        }
+        if (node.next != noNode) {
+            nodes[node.next].previous = node.previous;
+        }
+        node.linked = false;
+    }
+
+    ResultSlots<R, Capacity>& slots;
+    const std::chrono::nanoseconds tick;
+    const Deadline start;
+    int64_t reapedTick = -1;
+
+    std::mutex mutex;
+    Node nodes[Capacity];
+    uint32_t buckets[WheelSize];
+
+    std::mutex reapMutex;
+    std::vector<CallId> expired;
+};
+
+/// `ResultSlots` for each of `Rs`, as results of different Rpcs have different types:
+///
+/// ```
+/// rpc::PendingResults<1024, int, std::string> results;
+///
+/// packet.callId = *results.slots<R>().acquire();       // in sendRpcPacket<R>
+/// results.slots<R>().complete(callId, result);          // in onResultReturned<R>
+/// ```
+/// Call ids of different result types may repeat, results are matched by type first,
+/// so each type needs its own `DeadlineReaper`
+template<std::size_t Capacity, typename ...Rs>
+class PendingResults {
+public:
+    template<typename R>
+    ResultSlots<R, Capacity>& slots() { return std::get<ResultSlots<R, Capacity>>(tables); }
+
+private:
+    std::tuple<ResultSlots<Rs, Capacity>...> tables;
+};
+
+} // namespace rpc
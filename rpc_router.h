@@ -0,0 +1,290 @@
+#pragma once
+#include "rpc.h"
+
+#include <condition_variable>
+#include <exception>
+#include <limits>
+#include <memory>
+#include <thread>
+
+namespace rpc {
+
+/// Routes packets to interfaces by `RpcPacket::instanceId`. Instances are found in a dense table
+/// indexed by InstanceId, allocated in pages of `pageSize` ids as they are used. Both peers of
+/// an interface pair should use the same InstanceId:
+///
+/// ```
+/// rpc::InstanceRouter<MyInterface, Payload> router;
+/// for (auto& session : sessions) {
+///     router.add(session.interface); // by its `getInstanceId()`
+/// }
+/// router.dispatchBatch(packets);     // from transport
+/// ```
+/// Lookups are lock-free and may run concurrently with `add`, `remove` and each other. A removed interface may
+/// still be used by a dispatch that has already found it, so it should be destroyed only when such
+/// dispatches are over
+template<class Interface, typename Payload>
+class InstanceRouter {
+public:
+    static constexpr std::size_t pageSize = 1024;
+
+    InstanceRouter() = default;
+    InstanceRouter(const InstanceRouter&) = delete;
+    InstanceRouter& operator = (const InstanceRouter&) = delete;
+
+    ~InstanceRouter() {
+        for (auto& page : pages) {
+            delete[] page.load(std::memory_order_relaxed);
+        }
+    }
+
+    /// replaces an interface with the same InstanceId, if any
+    void add(Interface& interface) {
+        const InstanceId id = interface.getInstanceId();
+        std::lock_guard<std::mutex> lock(mutex);
+        auto& page = pages[id / pageSize];
+        if (!page.load(std::memory_order_relaxed)) {
+            page.store(new std::atomic<Interface*>[pageSize](), std::memory_order_release);
+        }
+        page.load(std::memory_order_relaxed)[id % pageSize].store(&interface, std::memory_order_release);
+    }
+
+    void remove(InstanceId id) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (auto* page = pages[id / pageSize].load(std::memory_order_relaxed)) {
+            page[id % pageSize].store(nullptr, std::memory_order_release);
+        }
+    }
+
+    /// null if there is no such instance
+    Interface* find(InstanceId id) const {
+        const auto* page = pages[id / pageSize].load(std::memory_order_acquire);
+        return page ? page[id % pageSize].load(std::memory_order_acquire) : nullptr;
+    }
+
+    /// returns false if there is no instance for the packet
+    bool dispatch(const RpcPacket<Payload>& packet) {
+        if (auto* interface = find(packet.instanceId)) {
+            interface->dispatch(packet);
+            return true;
+        }
+        return false;
+    }
+
+    /// Same as `RpcInterface::dispatchBatch`, for packets of many instances. Packets are grouped by
+    /// instance, then by call type and FunctionId, each instance and handler is resolved once per group.
+    /// Packets of unknown instances are skipped
+    void dispatchBatch(std::span<const RpcPacket<Payload>> packets) {
+        dispatchGrouped(packets, [](const PacketHandler<Payload>& handler, const RpcPacket<Payload>& packet, std::size_t) {
+            if (handler) {
+                handler(packet);
+            }
+        });
+    }
+
+    /// Same as above, but exceptions are stored in `statuses` as in `RpcInterface::dispatchBatch`.
+    /// Packets of unknown instances get `DispatchStatus::UnknownInstance`
+    void dispatchBatch(std::span<const RpcPacket<Payload>> packets, std::span<DispatchStatus> statuses) {
+        assert(statuses.size() >= packets.size());
+        std::fill_n(statuses.begin(), packets.size(), DispatchStatus::UnknownInstance);
+        dispatchGrouped(packets, [statuses](const PacketHandler<Payload>& handler, const RpcPacket<Payload>& packet, std::size_t index) {
+            if (!handler) {
+                statuses[index] = DispatchStatus::UnknownFunction;
+                return;
+            }
+            try {
+                handler(packet);
+                statuses[index] = DispatchStatus::Ok;
+            } catch (...) {
+                statuses[index] = DispatchStatus::HandlerFailed;
+            }
+        });
+    }
+
+private:
+    template<typename Visitor>
+    void dispatchGrouped(std::span<const RpcPacket<Payload>> packets, Visitor&& visit) {
+        // key is `instanceId | callType | functionId | packet index`, FunctionIds fit the wire header bits
+        static_assert(callTypeCount <= 4);
+        auto order = std::move(batchOrder());
+        order.clear();
+        order.reserve(packets.size());
+        for (std::size_t i = 0; i < packets.size(); ++i) {
+            const auto& packet = packets[i];
+            assert(packet.functionId <= wire::maxFunctionId);
+            order.push_back(uint64_t(packet.instanceId) << 48 | uint64_t(packet.callType) << 46
+                            | uint64_t(packet.functionId) << 32 | uint32_t(i));
+        }
+        std::sort(order.begin(), order.end());
+
+        Interface* interface = nullptr;
+        for (std::size_t begin = 0; begin < order.size();) {
+            const uint64_t group = order[begin] >> 32;
+            std::size_t end = begin + 1;
+            while (end < order.size() && (order[end] >> 32) == group) {
+                ++end;
+            }
+
+            const auto& first = packets[uint32_t(order[begin])];
+            if (begin == 0 || (order[begin - 1] >> 48) != (group >> 16)) {
+                interface = find(first.instanceId);
+            }
+            if (interface) {
+                const auto handler = interface->findHandler(first.callType, first.functionId);
+                for (std::size_t i = begin; i < end; ++i) {
+                    const std::size_t index = uint32_t(order[i]);
+                    visit(handler, packets[index], index);
+                }
+            }
+            begin = end;
+        }
+        batchOrder() = std::move(order);
+    }
+
+    // scratch buffer for `dispatchBatch`, per thread as batches of a router may be dispatched concurrently
+    static std::vector<uint64_t>& batchOrder() {
+        thread_local std::vector<uint64_t> order;
+        return order;
+    }
+
+    static constexpr std::size_t pageCount = (std::size_t(std::numeric_limits<InstanceId>::max()) + pageSize) / pageSize;
+
+    std::atomic<std::atomic<Interface*>*> pages[pageCount] = {};
+    std::mutex mutex;
+};
+
+/// Dispatches packets of many instances on worker threads. Every instance is served by a single
+/// worker, the one it is pinned to or `instanceId % threadCount()`, so its data stays in that
+/// worker's cache and its handlers need no synchronization. Workers take all queued packets at
+/// once and dispatch them as a batch, so packets of an instance are reordered as by `dispatchBatch`:
+///
+/// ```
+/// rpc::PinnedDispatcher<MyInterface, Payload> dispatcher(router, 4);
+/// dispatcher.pin(hotInstance, 0);
+/// dispatcher.post(std::move(packet)); // from transport
+/// ```
+/// Pinning should be changed only when no packets of the instance are queued.
+/// Failed packets are passed to the error handler if one is set, otherwise they are dropped
+template<class Interface, typename Payload>
+class PinnedDispatcher {
+public:
+    using ErrorHandler = InplaceFunction<void(const RpcPacket<Payload>&, DispatchStatus), 4 * sizeof(void*)>;
+
+    explicit PinnedDispatcher(InstanceRouter<Interface, Payload>& router,
+                              std::size_t threadCount = std::thread::hardware_concurrency())
+        : router(router), workers(std::max<std::size_t>(threadCount, 1)), pins(std::size_t(std::numeric_limits<InstanceId>::max()) + 1) {
+        assert(workers.size() < noPin);
+        for (auto& pin : pins) {
+            pin.store(noPin, std::memory_order_relaxed);
+        }
+        threads.reserve(workers.size());
+        for (std::size_t i = 0; i < workers.size(); ++i) {
+            threads.emplace_back([this, i] { run(workers[i]); });
+        }
+    }
+
+    PinnedDispatcher(const PinnedDispatcher&) = delete;
+    PinnedDispatcher& operator = (const PinnedDispatcher&) = delete;
+
+    /// handles everything already posted and stops workers
+    ~PinnedDispatcher() {
+        for (auto& worker : workers) {
+            {
+                std::lock_guard<std::mutex> lock(worker.mutex);
+                worker.stopping = true;
+            }
+            worker.wakeUp.notify_one();
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+    }
+
+    void pin(InstanceId id, std::size_t worker) {
+        assert(worker < workers.size());
+        pins[id].store(uint16_t(worker), std::memory_order_relaxed);
+    }
+
+    void unpin(InstanceId id) { pins[id].store(noPin, std::memory_order_relaxed); }
+
+    std::size_t workerOf(InstanceId id) const {
+        const auto pinned = pins[id].load(std::memory_order_relaxed);
+        return pinned != noPin ? pinned : id % workers.size();
+    }
+
+    template<typename F>
+    void setErrorHandler(F&& f) {
+        errorHandler = ErrorHandler(std::forward<F>(f));
+    }
+
+    void post(RpcPacket<Payload>&& packet) {
+        outstanding.fetch_add(1, std::memory_order_relaxed);
+        auto& worker = workers[workerOf(packet.instanceId)];
+        bool wasEmpty;
+        {
+            std::lock_guard<std::mutex> lock(worker.mutex);
+            wasEmpty = worker.packets.empty();
+            worker.packets.push_back(std::move(packet));
+        }
+        if (wasEmpty) {
+            worker.wakeUp.notify_one();
+        }
+    }
+
+    /// blocks until all posted packets are handled
+    void waitIdle() {
+        for (auto count = outstanding.load(std::memory_order_acquire); count != 0; count = outstanding.load(std::memory_order_acquire)) {
+            outstanding.wait(count, std::memory_order_acquire);
+        }
+    }
+
+    std::size_t threadCount() const { return threads.size(); }
+
+private:
+    static constexpr uint16_t noPin = ~uint16_t(0);
+
+    struct alignas(64) Worker {
+        std::mutex mutex;
+        std::condition_variable wakeUp;
+        std::vector<RpcPacket<Payload>> packets;
+        bool stopping = false;
+    };
+
+    void run(Worker& worker) {
+        std::vector<RpcPacket<Payload>> batch;
+        std::vector<DispatchStatus> statuses;
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(worker.mutex);
+                worker.wakeUp.wait(lock, [&] { return !worker.packets.empty() || worker.stopping; });
+                if (worker.packets.empty()) {
+                    return; // stopping
+                }
+                std::swap(batch, worker.packets);
+            }
+
+            statuses.resize(batch.size());
+            router.dispatchBatch(batch, statuses);
+            for (std::size_t i = 0; i < batch.size(); ++i) {
+                if (statuses[i] != DispatchStatus::Ok && errorHandler) {
+                    errorHandler(batch[i], statuses[i]);
+                }
+                Interface::releasePacket(std::move(batch[i]));
+            }
+            const auto handled = batch.size();
+            batch.clear(); // keeps capacity, the vectors are swapped back and forth
+            if (outstanding.fetch_sub(handled, std::memory_order_acq_rel) == handled) {
+                outstanding.notify_all();
+            }
+        }
+    }
+
+    InstanceRouter<Interface, Payload>& router;
+    std::vector<Worker> workers;
+    std::vector<std::atomic<uint16_t>> pins;
+    ErrorHandler errorHandler;
+    std::atomic<std::size_t> outstanding{0};
+    std::vector<std::thread> threads;
+};
+
+} // namespace rpc
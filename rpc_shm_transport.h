@@ -0,0 +1,408 @@
+#pragma once
+#include "rpc.h"
+
+#include <string>
+#include <system_error>
+#include <thread>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#if defined(__linux__)
+#include <climits>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+namespace rpc {
+
+/// How a reader waits for packets in an empty ring
+enum class Wakeup : uint8_t {
+    BusyPoll, ///< spins, lowest latency, burns a core
+    Futex,    ///< spins shortly, then sleeps on a futex in shared memory, woken by writers
+};
+
+namespace shm {
+
+inline void futexWait(std::atomic<uint32_t>* word, uint32_t expected) {
+#if defined(__linux__)
+    // shared futex, the word lives in memory mapped by several processes
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), FUTEX_WAIT, expected, nullptr, nullptr, 0);
+#else
+    (void)word;
+    (void)expected;
+    std::this_thread::yield();
+#endif
+}
+
+inline void futexWakeAll(std::atomic<uint32_t>* word) {
+#if defined(__linux__)
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+#else
+    (void)word;
+#endif
+}
+
+/// Record header, records are 8-byte aligned. `size` is written last and publishes the record.
+/// Packet header is a compact one, payload of one-way calls starts right after its short form.
+/// Packets with a deadline always have the full header, so `deadline` is there for them
+struct RecordHeader {
+    uint32_t size; // payload bytes | `committed`, or skipped bytes | `padding`
+    std::byte packet[wire::headerSize];
+    uint32_t deadline; // see `wire::packDeadline`, valid with the full packet header
+
+    static constexpr std::size_t payloadOffset(std::size_t packetHeaderSize) {
+        return (sizeof(uint32_t) + packetHeaderSize + 7) & ~std::size_t(7);
+    }
+
+    std::size_t payloadOffset() const { return payloadOffset(wire::compactHeaderSize(packet)); }
+    const std::byte* payload() const { return reinterpret_cast<const std::byte*>(this) + payloadOffset(); }
+};
+static_assert(sizeof(RecordHeader) == 16 && RecordHeader::payloadOffset(wire::headerSize) == sizeof(RecordHeader));
+
+/// Multi-producer single-consumer byte ring living in shared memory. Writers reserve space with
+/// a CAS on `head` and publish records independently, the reader consumes them in reservation order.
+/// Consumed bytes are zeroed, so a header is published only once its `size` is non-zero
+class Ring {
+public:
+    static constexpr uint32_t committed = 1u << 31;
+    static constexpr uint32_t padding = 1u << 30;
+    static constexpr uint32_t sizeMask = padding - 1;
+
+    struct Control {
+        alignas(64) std::atomic<uint64_t> head{0}; // reserved by writers
+        alignas(64) std::atomic<uint64_t> tail{0}; // consumed by reader
+        alignas(64) std::atomic<uint32_t> signal{0};
+        std::atomic<uint32_t> waiters{0};
+    };
+    static_assert(std::atomic<uint64_t>::is_always_lock_free && std::atomic<uint32_t>::is_always_lock_free);
+
+    Ring() = default;
+    Ring(Control* control, std::byte* data, std::size_t capacity) : control(control), data(data), capacity(capacity) {}
+
+    static constexpr std::size_t recordSize(std::size_t packetHeaderSize, std::size_t payloadSize) {
+        return (RecordHeader::payloadOffset(packetHeaderSize) + payloadSize + 7) & ~std::size_t(7);
+    }
+
+    /// records bigger than a half of the ring never fit
+    std::size_t maxRecordSize() const { return capacity / 2; }
+
+    /// Copies the packet header and `payload` into the ring. Returns false if the ring is full.
+    /// The record should take at most `maxRecordSize()`
+    template<typename Payload>
+    bool write(const RpcPacket<Payload>& packet, std::span<const std::byte> payload) {
+        const std::size_t size = recordSize(wire::compactHeaderSize(packet), payload.size());
+        assert(size <= maxRecordSize() && "Record is too large for the ring");
+        uint64_t head = control->head.load(std::memory_order_relaxed);
+        std::size_t skipped;
+        while (true) {
+            const std::size_t offset = head & (capacity - 1);
+            skipped = capacity - offset >= size ? 0 : capacity - offset; // records never wrap
+            if (head + skipped + size - control->tail.load(std::memory_order_acquire) > capacity) {
+                return false;
+            }
+            if (control->head.compare_exchange_weak(head, head + skipped + size, std::memory_order_relaxed)) {
+                break;
+            }
+        }
+        if (skipped != 0) {
+            publish(head, uint32_t(skipped) | padding);
+            head += skipped;
+        }
+        auto* header = headerAt(head);
+        const std::size_t headerSize = wire::writeCompactHeader(packet, header->packet);
+        if (headerSize == wire::headerSize) {
+            header->deadline = packet.deadline != noDeadline
+                ? wire::toLittleEndian(wire::packDeadline(packet.deadline, std::chrono::steady_clock::now()))
+                : 0;
+        }
+        const std::size_t offset = RecordHeader::payloadOffset(headerSize);
+        if (!payload.empty()) {
+            std::memcpy(reinterpret_cast<std::byte*>(header) + offset, payload.data(), payload.size());
+        }
+        publish(head, uint32_t(payload.size()) | committed);
+
+        control->signal.fetch_add(1);
+        if (control->waiters.load() != 0) {
+            futexWakeAll(&control->signal);
+        }
+        return true;
+    }
+
+    /// Calls `f(const RecordHeader&, std::span<const std::byte> payload)` for the next record, if any.
+    /// The record is consumed even if `f` throws, so a bad record is not read again
+    template<typename F>
+    bool read(F&& f) {
+        while (true) {
+            const uint64_t tail = control->tail.load(std::memory_order_relaxed);
+            auto* header = headerAt(tail);
+            const uint32_t size = std::atomic_ref<uint32_t>(header->size).load(std::memory_order_acquire);
+            if (size == 0) {
+                return false;
+            }
+            if (size & padding) {
+                consume(tail, size & sizeMask);
+                continue;
+            }
+            const std::size_t payloadSize = size & sizeMask;
+            struct Consume {
+                Ring& ring;
+                uint64_t tail;
+                std::size_t size;
+                ~Consume() { ring.consume(tail, size); }
+            } consume{*this, tail, recordSize(wire::compactHeaderSize(header->packet), payloadSize)};
+            f(std::as_const(*header), std::span<const std::byte>(header->payload(), payloadSize));
+            return true;
+        }
+    }
+
+    bool empty() const {
+        return std::atomic_ref<uint32_t>(headerAt(control->tail.load(std::memory_order_relaxed))->size).load(std::memory_order_acquire) == 0;
+    }
+
+    /// waits until the ring is not empty
+    void wait(Wakeup wakeup) {
+        for (int i = 0; i < spinCount || wakeup == Wakeup::BusyPoll; ++i) {
+            if (!empty()) {
+                return;
+            }
+            cpuRelax();
+        }
+        while (true) {
+            control->waiters.fetch_add(1);
+            const uint32_t signal = control->signal.load();
+            if (!empty()) {
+                control->waiters.fetch_sub(1);
+                return;
+            }
+            futexWait(&control->signal, signal);
+            control->waiters.fetch_sub(1);
+        }
+    }
+
+private:
+    static constexpr int spinCount = 4000;
+
+    RecordHeader* headerAt(uint64_t position) const {
+        return reinterpret_cast<RecordHeader*>(data + (position & (capacity - 1)));
+    }
+
+    void publish(uint64_t position, uint32_t size) {
+        std::atomic_ref<uint32_t>(headerAt(position)->size).store(size, std::memory_order_release);
+    }
+
+    void consume(uint64_t tail, std::size_t size) {
+        std::memset(data + (tail & (capacity - 1)), 0, size);
+        control->tail.store(tail + size, std::memory_order_release);
+    }
+
+    Control* control = nullptr;
+    std::byte* data = nullptr;
+    std::size_t capacity = 0;
+};
+
+} // namespace shm
+
+/// Transport between two processes over a POSIX shared memory segment named after the `InstanceId`
+/// of the connected interfaces. The segment holds a ring per direction, rings accept many writing
+/// threads and a single reading one. One side `create`s the channel, the other one `open`s it:
+///
+/// ```
+/// auto channel = rpc::ShmChannel<Payload>::create("my-service", instanceId);
+///
+/// template<typename R>
+/// auto sendRpcPacket(rpc::RpcPacket<Payload>&& packet) {
+///     while (!channel.send(packet)) {} // ring is full, the peer is behind. Too large packets throw
+///     /*...*/
+/// }
+///
+/// while (running) {
+///     channel.wait();
+///     channel.poll(receiver);
+/// }
+/// ```
+/// Packet headers and payload bytes are copied straight into the ring, and received packets are
+/// rebuilt from recycled packets. Payloads with `borrow(std::span<const std::byte>)` refer to the ring
+/// and are handled in place, so a call costs a single copy of its payload and no allocations, other
+/// payloads are copied out with `assign`. `Payload` should provide `bytes()` and `assign`, as `BinaryPayload` does.
+/// Packet headers use the `rpc::wire` layout. Ring control words are in host byte order, so both processes
+/// should run on the same machine, as shared memory implies anyway
+template<typename Payload>
+class ShmChannel {
+public:
+    static ShmChannel create(std::string_view prefix, InstanceId instanceId, std::size_t ringCapacity = 1 << 20,
+                             Wakeup wakeup = Wakeup::Futex) {
+        assert(ringCapacity != 0 && (ringCapacity & (ringCapacity - 1)) == 0 && "Ring capacity should be a power of two");
+        ShmChannel channel(segmentName(prefix, instanceId), wakeup, true);
+        const int fd = ::shm_open(channel.name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+        if (fd < 0) {
+            throw std::system_error(errno, std::generic_category(), "shm_open " + channel.name);
+        }
+        const std::size_t size = segmentSize(ringCapacity);
+        if (::ftruncate(fd, off_t(size)) != 0) {
+            const int error = errno;
+            ::close(fd);
+            throw std::system_error(error, std::generic_category(), "ftruncate " + channel.name);
+        }
+        channel.map(fd, size);
+        auto* header = ::new (channel.segment) SegmentHeader{};
+        header->ringCapacity = ringCapacity;
+        ::new (channel.control(0)) shm::Ring::Control{};
+        ::new (channel.control(1)) shm::Ring::Control{};
+        std::atomic_ref<uint32_t>(header->magic).store(SegmentHeader::expectedMagic, std::memory_order_release);
+        channel.attachRings(ringCapacity);
+        return channel;
+    }
+
+    /// throws if the segment does not exist or is not initialized yet
+    static ShmChannel open(std::string_view prefix, InstanceId instanceId, Wakeup wakeup = Wakeup::Futex) {
+        ShmChannel channel(segmentName(prefix, instanceId), wakeup, false);
+        const int fd = ::shm_open(channel.name.c_str(), O_RDWR, 0600);
+        if (fd < 0) {
+            throw std::system_error(errno, std::generic_category(), "shm_open " + channel.name);
+        }
+        struct stat info;
+        if (::fstat(fd, &info) != 0 || std::size_t(info.st_size) < sizeof(SegmentHeader)) {
+            ::close(fd);
+            throw std::system_error(EINVAL, std::generic_category(), "shm segment " + channel.name);
+        }
+        channel.map(fd, std::size_t(info.st_size));
+        auto* header = static_cast<SegmentHeader*>(channel.segment);
+        if (std::atomic_ref<uint32_t>(header->magic).load(std::memory_order_acquire) != SegmentHeader::expectedMagic
+            || segmentSize(header->ringCapacity) != channel.size) {
+            throw std::system_error(EINVAL, std::generic_category(), "shm segment " + channel.name);
+        }
+        channel.attachRings(header->ringCapacity);
+        return channel;
+    }
+
+    ShmChannel(ShmChannel&& other) noexcept
+        : name(std::move(other.name)), segment(std::exchange(other.segment, nullptr)), size(other.size),
+          wakeup(other.wakeup), owner(other.owner), inbound(other.inbound), outbound(other.outbound) {}
+
+    ShmChannel& operator = (ShmChannel&&) = delete;
+    ShmChannel(const ShmChannel&) = delete;
+
+    /// creator also removes the segment name, mappings stay valid until both sides are gone
+    ~ShmChannel() {
+        if (segment) {
+            ::munmap(segment, size);
+            if (owner) {
+                ::shm_unlink(name.c_str());
+            }
+        }
+    }
+
+    /// Returns false if the ring is full, packet is not sent then. Throws `std::system_error` with
+    /// `EMSGSIZE` for packets that never fit, taking more than a half of the ring
+    bool send(const RpcPacket<Payload>& packet) {
+        const auto payload = packet.payload.bytes();
+        if (shm::Ring::recordSize(wire::compactHeaderSize(packet), payload.size()) > outbound.maxRecordSize()) {
+            throw std::system_error(EMSGSIZE, std::generic_category(), "shm packet is larger than a half of the ring");
+        }
+        return outbound.write(packet, payload);
+    }
+
+    /// Dispatches up to `maxPackets` received packets, returns how many were received. A record is
+    /// consumed even if its handler throws, so a throwing handler does not stall the ring:
+    /// the exception is propagated and the next `poll` goes on with the following packets
+    template<class Interface>
+    std::size_t poll(Interface& interface, std::size_t maxPackets = 64) {
+        std::size_t count = 0;
+        for (; count < maxPackets; ++count) {
+            RpcPacket<Payload> packet = Interface::acquirePacket();
+            try {
+                bool valid = false;
+                if (!inbound.read([&](const shm::RecordHeader& header, std::span<const std::byte> payload) {
+                    valid = wire::readCompactHeader(header.packet, packet);
+                    if (!valid) {
+                        return;
+                    }
+                    packet.deadline = wire::compactHeaderSize(header.packet) == wire::headerSize && header.deadline != 0
+                        ? wire::unpackDeadline(wire::toLittleEndian(header.deadline), std::chrono::steady_clock::now())
+                        : noDeadline;
+                    if constexpr (borrowsPayload) {
+                        // the record is consumed only after the handler is done with it
+                        packet.payload.borrow(payload);
+                        interface.dispatch(packet);
+                    } else {
+                        packet.payload.assign(payload);
+                    }
+                })) {
+                    Interface::releasePacket(std::move(packet));
+                    break;
+                }
+                if (!borrowsPayload && valid) {
+                    interface.dispatch(packet);
+                }
+            } catch (...) {
+                Interface::releasePacket(std::move(packet));
+                throw;
+            }
+            Interface::releasePacket(std::move(packet));
+        }
+        return count;
+    }
+
+    /// blocks until a packet is received, using the wakeup mode of this side
+    void wait() { inbound.wait(wakeup); }
+
+private:
+    static constexpr bool borrowsPayload = requires(Payload& payload, std::span<const std::byte> bytes) { payload.borrow(bytes); };
+
+    struct SegmentHeader {
+        static constexpr uint32_t expectedMagic = 0x52504332; // "RPC2", record layout version
+        uint32_t magic = 0;
+        std::size_t ringCapacity = 0;
+    };
+
+    static constexpr std::size_t controlOffset = 64;
+
+    static std::size_t segmentSize(std::size_t ringCapacity) {
+        return controlOffset + 2 * (sizeof(shm::Ring::Control) + ringCapacity);
+    }
+
+    static std::string segmentName(std::string_view prefix, InstanceId instanceId) {
+        return "/" + std::string(prefix) + "." + std::to_string(instanceId);
+    }
+
+    ShmChannel(std::string name, Wakeup wakeup, bool owner) : name(std::move(name)), wakeup(wakeup), owner(owner) {}
+
+    void map(int fd, std::size_t mappedSize) {
+        void* address = ::mmap(nullptr, mappedSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        const int error = errno;
+        ::close(fd);
+        if (address == MAP_FAILED) {
+            throw std::system_error(error, std::generic_category(), "mmap " + name);
+        }
+        segment = address;
+        size = mappedSize;
+    }
+
+    void* control(int ring) const {
+        return static_cast<std::byte*>(segment) + controlOffset + ring * (sizeof(shm::Ring::Control) + ringCapacity());
+    }
+
+    std::size_t ringCapacity() const { return static_cast<const SegmentHeader*>(segment)->ringCapacity; }
+
+    void attachRings(std::size_t capacity) {
+        auto ring = [&](int index) {
+            auto* control = static_cast<shm::Ring::Control*>(this->control(index));
+            return shm::Ring(control, reinterpret_cast<std::byte*>(control + 1), capacity);
+        };
+        // ring 0 carries packets from the creator to the other side, ring 1 back
+        outbound = ring(owner ? 0 : 1);
+        inbound = ring(owner ? 1 : 0);
+    }
+
+    std::string name;
+    void* segment = nullptr;
+    std::size_t size = 0;
+    Wakeup wakeup;
+    bool owner;
+    shm::Ring inbound;
+    shm::Ring outbound;
+};
+
+} // namespace rpc
@@ -0,0 +1,444 @@
+#pragma once
+#include "rpc.h"
+
+#include <climits>
+#include <string>
+#include <system_error>
+
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace rpc {
+
+/// When queued outgoing packets are written. With default limits every packet is written right away
+struct CoalescingLimits {
+    /// queued bytes, including frame headers, that trigger a write. 0 writes every packet
+    std::size_t maxBytes = 0;
+    /// oldest queued packet is written no later than this, checked by `send` and `flushIfDue`
+    std::chrono::steady_clock::duration maxDelay{0};
+};
+
+namespace socket {
+
+/// Stream framing of a packet, followed by payload bytes. All fields are little-endian.
+/// Packet header is a compact one, so frames of one-way calls are 4 bytes shorter than `FrameHeader`.
+/// With `hasDeadline` set in `payloadSize` the packet header is followed by `wire::deadlineSize` bytes
+/// of time left (see `wire::packDeadline`)
+struct FrameHeader {
+    static constexpr uint32_t hasDeadline = 1u << 31;
+
+    uint32_t payloadSize;
+    std::byte packet[wire::headerSize + wire::deadlineSize];
+
+    /// bytes needed to know the frame header size
+    static constexpr std::size_t minSize = sizeof(uint32_t) + wire::shortHeaderSize;
+
+    std::size_t size() const { return wire::toLittleEndian(payloadSize) & ~hasDeadline; }
+    bool deadline() const { return wire::toLittleEndian(payloadSize) & hasDeadline; }
+    /// valid once `minSize` bytes are read
+    std::size_t headerSize() const {
+        return sizeof(uint32_t) + wire::compactHeaderSize(packet) + (deadline() ? wire::deadlineSize : 0);
+    }
+};
+static_assert(sizeof(FrameHeader) == 16);
+
+[[noreturn]] inline void throwError(const char* what) {
+    throw std::system_error(errno, std::generic_category(), what);
+}
+
+inline int connectUnix(const std::string& path) {
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path)) {
+        throw std::system_error(ENAMETOOLONG, std::generic_category(), "connect " + path);
+    }
+    std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+    const int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        throwError("socket");
+    }
+    if (::connect(fd, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) != 0) {
+        const int error = errno;
+        ::close(fd);
+        throw std::system_error(error, std::generic_category(), "connect " + path);
+    }
+    return fd;
+}
+
+inline int connectTcp(const std::string& host, uint16_t port) {
+    addrinfo hints{};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* addresses = nullptr;
+    if (const int error = ::getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &addresses); error != 0) {
+        throw std::runtime_error("getaddrinfo " + host + ": " + ::gai_strerror(error));
+    }
+    int fd = -1;
+    int error = 0;
+    for (auto* address = addresses; address && fd < 0; address = address->ai_next) {
+        fd = ::socket(address->ai_family, address->ai_socktype | SOCK_CLOEXEC, address->ai_protocol);
+        if (fd >= 0 && ::connect(fd, address->ai_addr, address->ai_addrlen) != 0) {
+            error = errno;
+            ::close(fd);
+            fd = -1;
+        }
+    }
+    ::freeaddrinfo(addresses);
+    if (fd < 0) {
+        throw std::system_error(error, std::generic_category(), "connect " + host);
+    }
+    // coalescing is done by the connection, kernel should not delay writes on its own
+    const int noDelay = 1;
+    ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+    return fd;
+}
+
+/// Listening TCP or Unix domain socket
+class Listener {
+public:
+    static Listener listenUnix(const std::string& path) {
+        sockaddr_un address{};
+        address.sun_family = AF_UNIX;
+        if (path.size() >= sizeof(address.sun_path)) {
+            throw std::system_error(ENAMETOOLONG, std::generic_category(), "bind " + path);
+        }
+        std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+        ::unlink(path.c_str());
+        return Listener(AF_UNIX, reinterpret_cast<const sockaddr*>(&address), sizeof(address));
+    }
+
+    static Listener listenTcp(uint16_t port) {
+        sockaddr_in address{};
+        address.sin_family = AF_INET;
+        address.sin_port = htons(port);
+        address.sin_addr.s_addr = htonl(INADDR_ANY);
+        return Listener(AF_INET, reinterpret_cast<const sockaddr*>(&address), sizeof(address));
+    }
+
+    Listener(Listener&& other) noexcept : fd(std::exchange(other.fd, -1)) {}
+    Listener& operator = (Listener&&) = delete;
+
+    ~Listener() {
+        if (fd >= 0) {
+            ::close(fd);
+        }
+    }
+
+    /// blocks until a peer connects and returns its socket
+    int accept() {
+        while (true) {
+            const int peer = ::accept4(fd, nullptr, nullptr, SOCK_CLOEXEC);
+            if (peer >= 0) {
+                const int noDelay = 1;
+                ::setsockopt(peer, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay)); // fails harmlessly for Unix sockets
+                return peer;
+            }
+            if (errno != EINTR) {
+                throwError("accept");
+            }
+        }
+    }
+
+    /// bound port, useful after binding port 0
+    uint16_t port() const {
+        sockaddr_in address{};
+        socklen_t size = sizeof(address);
+        ::getsockname(fd, reinterpret_cast<sockaddr*>(&address), &size);
+        return ntohs(address.sin_port);
+    }
+
+private:
+    Listener(int family, const sockaddr* address, socklen_t size) {
+        fd = ::socket(family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+            throwError("socket");
+        }
+        const int reuse = 1;
+        ::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+        if (::bind(fd, address, size) != 0 || ::listen(fd, SOMAXCONN) != 0) {
+            const int error = errno;
+            ::close(fd);
+            throw std::system_error(error, std::generic_category(), "listen");
+        }
+    }
+
+    int fd = -1;
+};
+
+} // namespace socket
+
+/// Stream socket transport for an interface, works over TCP and Unix domain sockets.
+/// Outgoing packets are queued and written with a single `sendmsg` per batch, as limited by
+/// `CoalescingLimits`. Incoming bytes are read in large chunks into a reusable buffer, every
+/// complete packet in it is rebuilt from recycled packets and dispatched in the order it arrived:
+///
+/// ```
+/// rpc::SocketConnection<MyInterface, Payload> connection(rpc::socket::connectTcp("localhost", 4000),
+///                                                         {.maxBytes = 16 * 1024, .maxDelay = 50us});
+///
+/// connection.send(std::move(packet)); // in sendRpcPacket
+/// connection.receive(receiver);       // reader loop, blocks until some bytes are read
+/// connection.flushIfDue();            // timer or event loop, when `maxDelay` is set
+/// ```
+/// `send` and `flush` may be called from many threads, `receive` from one thread at a time.
+/// Frame headers are little-endian, see `rpc::wire`, payload encoding is up to the `Payload`.
+/// `Payload` should provide `bytes()` and `assign(std::span<const std::byte>)`, as `BinaryPayload` does.
+/// Payloads with `borrow(std::span<const std::byte>)` refer to the read buffer instead of copying it,
+/// they are valid until the handler returns
+template<class Interface, typename Payload>
+class SocketConnection {
+public:
+    static constexpr std::size_t readChunk = 64 * 1024;
+    /// bigger frames are treated as a corrupted stream
+    static constexpr std::size_t maxPayloadSize = 64 * 1024 * 1024;
+
+    /// takes ownership of a connected socket
+    explicit SocketConnection(int fd, CoalescingLimits limits = {}) : fd(fd), limits(limits) {}
+
+    SocketConnection(const SocketConnection&) = delete;
+    SocketConnection& operator = (const SocketConnection&) = delete;
+
+    /// Makes `receive` pass each burst to `dispatchBatch`, which handles packets grouped by Rpc.
+    /// Packets of different Rpcs are then not handled in the order they were sent
+    void setBatchDispatch(bool enabled) { batchDispatch = enabled; }
+
+    ~SocketConnection() {
+        try {
+            flush();
+        } catch (const std::system_error&) {
+            // peer is gone, queued packets are lost anyway
+        }
+        ::close(fd);
+    }
+
+    void send(RpcPacket<Payload>&& packet) {
+        std::lock_guard<std::mutex> lock(sendMutex);
+        if (queue.empty()) {
+            firstQueuedTime = std::chrono::steady_clock::now();
+        }
+        queuedBytes += sizeof(uint32_t) + wire::compactHeaderSize(packet) + packet.payload.bytes().size()
+                     + (packet.deadline != noDeadline ? wire::deadlineSize : 0);
+        queue.push_back(std::move(packet));
+
+        if (queuedBytes >= limits.maxBytes
+            || (limits.maxDelay.count() != 0 && std::chrono::steady_clock::now() - firstQueuedTime >= limits.maxDelay)) {
+            writeQueued();
+        }
+    }
+
+    /// writes all queued packets
+    void flush() {
+        std::lock_guard<std::mutex> lock(sendMutex);
+        writeQueued();
+    }
+
+    /// writes queued packets if the oldest one waits longer than `maxDelay`, returns true if it did
+    bool flushIfDue() {
+        std::lock_guard<std::mutex> lock(sendMutex);
+        if (queue.empty() || std::chrono::steady_clock::now() - firstQueuedTime < limits.maxDelay) {
+            return false;
+        }
+        writeQueued();
+        return true;
+    }
+
+    /// Reads available bytes, blocking until there are some, and dispatches complete packets.
+    /// Returns the number of dispatched packets, zero as well when the peer has closed the connection.
+    /// Exceptions of handlers are propagated, the rest of the burst is dropped
+    std::size_t receive(Interface& interface) {
+        if (input.size() - inputEnd < readChunk) {
+            compactInput();
+        }
+        ssize_t count;
+        do {
+            count = ::read(fd, input.data() + inputEnd, input.size() - inputEnd);
+        } while (count < 0 && errno == EINTR);
+        if (count < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            }
+            socket::throwError("read");
+        }
+        if (count == 0) {
+            peerClosed = true;
+            return 0;
+        }
+        inputEnd += std::size_t(count);
+        return dispatchInput(interface);
+    }
+
+    bool closed() const { return peerClosed; }
+    int nativeHandle() const { return fd; }
+
+private:
+    // releases packets and clears the vector however the scope is left
+    struct ReleaseAll {
+        std::vector<RpcPacket<Payload>>& packets;
+
+        ~ReleaseAll() {
+            for (auto& packet : packets) {
+                Interface::releasePacket(std::move(packet));
+            }
+            packets.clear();
+        }
+    };
+
+    // a failed write leaves a partial frame in the stream, so queued packets are dropped either way
+    void writeQueued() {
+        ReleaseAll release{queue};
+        queuedBytes = 0;
+        const auto now = std::chrono::steady_clock::now();
+        std::size_t sent = 0;
+        while (sent < queue.size()) {
+            const std::size_t batch = std::min<std::size_t>(queue.size() - sent, IOV_MAX / 2);
+            headers.resize(batch);
+            iovecs.resize(2 * batch);
+            for (std::size_t i = 0; i < batch; ++i) {
+                const auto& packet = queue[sent + i];
+                const auto payload = packet.payload.bytes();
+                auto& header = headers[i];
+                std::size_t headerSize = wire::writeCompactHeader(packet, header.packet);
+                uint32_t size = uint32_t(payload.size());
+                if (packet.deadline != noDeadline) {
+                    const uint32_t left = wire::toLittleEndian(wire::packDeadline(packet.deadline, now));
+                    std::memcpy(header.packet + headerSize, &left, wire::deadlineSize);
+                    headerSize += wire::deadlineSize;
+                    size |= socket::FrameHeader::hasDeadline;
+                }
+                header.payloadSize = wire::toLittleEndian(size);
+                headerSize += sizeof(uint32_t);
+                iovecs[2 * i] = {&header, headerSize};
+                iovecs[2 * i + 1] = {const_cast<std::byte*>(payload.data()), payload.size()};
+            }
+            writeAll(iovecs.data(), iovecs.size());
+            sent += batch;
+        }
+    }
+
+    void writeAll(iovec* vectors, std::size_t count) {
+        while (count != 0) {
+            // sendmsg is writev with flags, a closed peer should not raise SIGPIPE
+            msghdr message{};
+            message.msg_iov = vectors;
+            message.msg_iovlen = count;
+            const ssize_t written = ::sendmsg(fd, &message, MSG_NOSIGNAL);
+            if (written < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    pollfd descriptor{fd, POLLOUT, 0};
+                    ::poll(&descriptor, 1, -1);
+                    continue;
+                }
+                socket::throwError("sendmsg");
+            }
+            // skip fully written vectors, adjust the partially written one
+            std::size_t remaining = std::size_t(written);
+            while (count != 0 && remaining >= vectors->iov_len) {
+                remaining -= vectors->iov_len;
+                ++vectors;
+                --count;
+            }
+            if (count != 0) {
+                vectors->iov_base = static_cast<char*>(vectors->iov_base) + remaining;
+                vectors->iov_len -= remaining;
+            }
+        }
+    }
+
+    // Frames are consumed as they are parsed, so an exception from a payload or a handler drops the
+    // rest of this burst but doesn't make the next `receive` see the same frames again
+    std::size_t dispatchInput(Interface& interface) {
+        ReleaseAll release{received};
+        const auto now = std::chrono::steady_clock::now();
+        std::size_t offset = inputBegin;
+        while (inputEnd - offset >= socket::FrameHeader::minSize) {
+            socket::FrameHeader header;
+            std::memcpy(&header, input.data() + offset, socket::FrameHeader::minSize);
+            if (header.size() > maxPayloadSize) {
+                throw std::system_error(EBADMSG, std::generic_category(), "rpc frame");
+            }
+            const std::size_t headerSize = header.headerSize();
+            const std::size_t frameSize = headerSize + header.size();
+            if (inputEnd - offset < frameSize) {
+                break;
+            }
+            std::memcpy(&header, input.data() + offset, headerSize);
+            auto& packet = received.emplace_back(Interface::acquirePacket());
+            if (!wire::readCompactHeader(header.packet, packet)) {
+                throw std::system_error(EBADMSG, std::generic_category(), "rpc frame");
+            }
+            packet.deadline = noDeadline;
+            if (header.deadline()) {
+                uint32_t left;
+                std::memcpy(&left, header.packet + wire::compactHeaderSize(header.packet), wire::deadlineSize);
+                packet.deadline = wire::unpackDeadline(wire::toLittleEndian(left), now);
+            }
+            const auto* payload = input.data() + offset + headerSize;
+            offset += frameSize;
+            inputBegin = offset;
+            // the buffer is compacted only by the next `receive`, after these packets are handled
+            const std::span<const std::byte> bytes(payload, header.size());
+            if constexpr (requires { packet.payload.borrow(bytes); }) {
+                packet.payload.borrow(bytes);
+            } else {
+                packet.payload.assign(bytes);
+            }
+        }
+
+        if (batchDispatch) {
+            interface.dispatchBatch(received);
+        } else {
+            for (const auto& packet : received) {
+                interface.dispatch(packet);
+            }
+        }
+        return received.size();
+    }
+
+    // moves an incomplete frame to the front, grows the buffer to fit it
+    void compactInput() {
+        const std::size_t pending = inputEnd - inputBegin;
+        if (inputBegin != 0) {
+            std::memmove(input.data(), input.data() + inputBegin, pending);
+            inputBegin = 0;
+            inputEnd = pending;
+        }
+        std::size_t needed = pending + readChunk;
+        if (pending >= socket::FrameHeader::minSize) {
+            socket::FrameHeader header;
+            std::memcpy(&header, input.data(), socket::FrameHeader::minSize);
+            needed = std::max(needed, header.headerSize() + std::min(header.size(), maxPayloadSize));
+        }
+        if (input.size() < needed) {
+            input.resize(needed);
+        }
+    }
+
+    int fd;
+    CoalescingLimits limits;
+    bool batchDispatch = false;
+    bool peerClosed = false;
+
+    std::mutex sendMutex;
+    std::vector<RpcPacket<Payload>> queue;
+    std::size_t queuedBytes = 0;
+    std::chrono::steady_clock::time_point firstQueuedTime;
+    std::vector<socket::FrameHeader> headers;
+    std::vector<iovec> iovecs;
+
+    std::vector<std::byte> input;
+    std::size_t inputBegin = 0;
+    std::size_t inputEnd = 0;
+    std::vector<RpcPacket<Payload>> received;
+};
+
+} // namespace rpc
@@ -0,0 +1,313 @@
+#pragma once
+#include "rpc.h"
+
+#include <array>
+#include <atomic>
+#include <bit>
+#include <memory>
+#include <vector>
+
+namespace rpc {
+
+/// Log-linear histogram of non-negative values, e.g. nanoseconds. Each power of two range is split
+/// into `subBuckets` equal buckets, so recorded values keep 3 significant bits (12.5% error) over
+/// the whole range. Values of `2^maxValueBits` and above go to the last bucket
+class Histogram {
+public:
+    static constexpr unsigned subBucketBits = 3;
+    static constexpr uint64_t subBuckets = 1u << subBucketBits;
+    static constexpr unsigned maxValueBits = 40; // ~18 minutes in nanoseconds
+    static constexpr std::size_t bucketCount = subBuckets * (maxValueBits - subBucketBits + 1);
+
+    static constexpr std::size_t bucketOf(uint64_t value) {
+        if (value < subBuckets) {
+            return std::size_t(value);
+        }
+        const unsigned exponent = unsigned(std::bit_width(value)) - 1;
+        if (exponent >= maxValueBits) {
+            return bucketCount - 1;
+        }
+        const unsigned shift = exponent - subBucketBits;
+        return std::size_t(subBuckets * (shift + 1) + ((value >> shift) & (subBuckets - 1)));
+    }
+
+    /// the smallest value that goes to `bucket`
+    static constexpr uint64_t lowerBound(std::size_t bucket) {
+        if (bucket < subBuckets) {
+            return bucket;
+        }
+        const unsigned shift = unsigned(bucket / subBuckets) - 1;
+        return (subBuckets + bucket % subBuckets) << shift;
+    }
+
+    /// the largest value that goes to `bucket`
+    static constexpr uint64_t upperBound(std::size_t bucket) {
+        return bucket + 1 < bucketCount ? lowerBound(bucket + 1) - 1 : ~uint64_t(0);
+    }
+
+    void record(uint64_t value) {
+        ++counts[bucketOf(value)];
+        ++total;
+        sum += value;
+        maximum = std::max(maximum, value);
+    }
+
+    void merge(const Histogram& other) {
+        for (std::size_t i = 0; i < bucketCount; ++i) {
+            counts[i] += other.counts[i];
+        }
+        total += other.total;
+        sum += other.sum;
+        maximum = std::max(maximum, other.maximum);
+    }
+
+    uint64_t count() const { return total; }
+    uint64_t max() const { return maximum; }
+    double mean() const { return total ? double(sum) / double(total) : 0.0; }
+    uint64_t bucket(std::size_t index) const { return counts[index]; }
+
+    /// the largest value of the bucket holding `q`-th quantile, `q` is in [0, 1]. 0 if empty
+    uint64_t quantile(double q) const {
+        if (total == 0) {
+            return 0;
+        }
+        const auto rank = std::max<uint64_t>(1, uint64_t(q * double(total) + 0.5));
+        uint64_t seen = 0;
+        for (std::size_t i = 0; i < bucketCount; ++i) {
+            seen += counts[i];
+            if (seen >= rank) {
+                return std::min(upperBound(i), maximum);
+            }
+        }
+        return maximum;
+    }
+
+private:
+    template<std::size_t, std::size_t> friend class RpcStats;
+
+    std::array<uint64_t, bucketCount> counts = {};
+    uint64_t total = 0;
+    uint64_t sum = 0;
+    uint64_t maximum = 0;
+};
+
+/// Statistics of a single Rpc. Coalesced calls are counted per packet.
+/// Times are in nanoseconds
+struct RpcFunctionStats {
+    FunctionId functionId = 0;
+    uint64_t callsSent = 0;
+    uint64_t callsReceived = 0;
+    uint64_t resultsSent = 0;
+    uint64_t resultsReceived = 0;
+    uint64_t cancelsSent = 0;
+    uint64_t cancelsReceived = 0;
+    uint64_t bytesSent = 0;     ///< payload bytes of calls and results
+    uint64_t bytesReceived = 0;
+    Histogram handlerTime;      ///< receiver side, from handler start until it returns
+    Histogram latency;          ///< caller side, from sending a call until dispatching its result
+};
+
+/// Per-Rpc statistics, enabled through `Config::Stats`:
+///
+/// ```
+/// struct MyConfig : rpc::DefaultConfig {
+///     using Stats = rpc::RpcStats<>;
+/// };
+///
+/// auto stats = interface.getStats().snapshot(interface.square.getFunctionId());
+/// std::cout << stats.latency.quantile(0.99) << "ns\n";
+/// ```
+/// Counters are sharded: every thread updates one of `Shards` copies picked once per thread,
+/// so concurrent callers rarely touch the same cache lines. `snapshot` sums them up and may run
+/// concurrently with updates. Latency is matched by call id: the id the packet has when `sendRpcPacket`
+/// returns should come back with the result. `sendRpcPacket` may assign its own id, but then results
+/// dispatched before it returns are not sampled. Neither are calls outstanding for more than `LatencySlots`
+/// later calls.
+/// Every Rpc of every instance takes about `Shards * 5KiB`, so interfaces with many Rpcs or instances
+/// should use fewer shards
+template<std::size_t Shards = 8, std::size_t LatencySlots = 1024>
+class RpcStats {
+    static_assert(Shards != 0);
+    static_assert(LatencySlots != 0 && (LatencySlots & (LatencySlots - 1)) == 0, "LatencySlots should be a power of two");
+
+public:
+    static constexpr bool enabled = true;
+
+    RpcStats() : startTimes(new StartTime[LatencySlots]) {}
+    RpcStats(const RpcStats&) = delete;
+    RpcStats& operator = (const RpcStats&) = delete;
+
+    /// statistics of every Rpc, in registration order
+    std::vector<RpcFunctionStats> snapshot() const {
+        std::vector<RpcFunctionStats> result;
+        result.reserve(functions.size());
+        for (const auto& function : functions) {
+            result.push_back(snapshot(function.functionId));
+        }
+        return result;
+    }
+
+    /// statistics of Rpc with `functionId`, zeroes if there is none
+    RpcFunctionStats snapshot(FunctionId functionId) const {
+        RpcFunctionStats stats;
+        stats.functionId = functionId;
+        if (functionId < indices.size() && indices[functionId] != noIndex) {
+            for (std::size_t shard = 0; shard < Shards; ++shard) {
+                const auto& counters = functions[indices[functionId]].shards[shard];
+                stats.callsSent += counters.callsSent.load(std::memory_order_relaxed);
+                stats.callsReceived += counters.callsReceived.load(std::memory_order_relaxed);
+                stats.resultsSent += counters.resultsSent.load(std::memory_order_relaxed);
+                stats.resultsReceived += counters.resultsReceived.load(std::memory_order_relaxed);
+                stats.cancelsSent += counters.cancelsSent.load(std::memory_order_relaxed);
+                stats.cancelsReceived += counters.cancelsReceived.load(std::memory_order_relaxed);
+                stats.bytesSent += counters.bytesSent.load(std::memory_order_relaxed);
+                stats.bytesReceived += counters.bytesReceived.load(std::memory_order_relaxed);
+                counters.handlerTime.addTo(stats.handlerTime);
+                counters.latency.addTo(stats.latency);
+            }
+        }
+        return stats;
+    }
+
+    // hooks called by Rpcs, see `NoStats`
+
+    /// called while the interface is constructed, before any traffic
+    void addFunction(FunctionId functionId) {
+        if (functionId >= indices.size()) {
+            indices.resize(functionId + 1, noIndex);
+        }
+        assert(indices[functionId] == noIndex);
+        indices[functionId] = uint16_t(functions.size());
+        functions.push_back({functionId, std::unique_ptr<Counters[]>(new Counters[Shards])});
+    }
+
+    void onSent(FunctionId functionId, CallType callType, std::size_t payloadBytes) {
+        auto& counters = local(functionId);
+        counters.sent(callType).fetch_add(1, std::memory_order_relaxed);
+        counters.bytesSent.fetch_add(payloadBytes, std::memory_order_relaxed);
+    }
+
+    void onCallStarted(FunctionId, CallId callId) {
+        startCall(callId, now());
+    }
+
+    void onCallIdChanged(FunctionId, CallId previous, CallId callId) {
+        auto& start = startTimes[previous & (LatencySlots - 1)];
+        const auto time = start.time.load(std::memory_order_relaxed);
+        CallId expected = previous;
+        if (start.callId.compare_exchange_strong(expected, 0, std::memory_order_acquire)) {
+            startCall(callId, time);
+        }
+    }
+
+    void onReceived(FunctionId functionId, CallType callType, std::size_t payloadBytes) {
+        auto& counters = local(functionId);
+        counters.received(callType).fetch_add(1, std::memory_order_relaxed);
+        counters.bytesReceived.fetch_add(payloadBytes, std::memory_order_relaxed);
+    }
+
+    void onHandled(FunctionId functionId, std::chrono::nanoseconds time) {
+        local(functionId).handlerTime.record(uint64_t(std::max<int64_t>(time.count(), 0)));
+    }
+
+    void onResultReturned(FunctionId functionId, CallId callId) {
+        auto& start = startTimes[callId & (LatencySlots - 1)];
+        if (start.callId.load(std::memory_order_acquire) != callId) {
+            return;
+        }
+        const auto time = start.time.load(std::memory_order_relaxed);
+        // fails if the slot was taken by a later call meanwhile, or the result is a duplicate
+        CallId expected = callId;
+        if (start.callId.compare_exchange_strong(expected, 0, std::memory_order_relaxed)) {
+            local(functionId).latency.record(uint64_t(std::max<int64_t>(now() - time, 0)));
+        }
+    }
+
+private:
+    class AtomicHistogram {
+    public:
+        void record(uint64_t value) {
+            counts[Histogram::bucketOf(value)].fetch_add(1, std::memory_order_relaxed);
+            sum.fetch_add(value, std::memory_order_relaxed);
+            auto maximum = this->maximum.load(std::memory_order_relaxed);
+            while (value > maximum && !this->maximum.compare_exchange_weak(maximum, value, std::memory_order_relaxed)) {}
+        }
+
+        void addTo(Histogram& histogram) const {
+            for (std::size_t i = 0; i < Histogram::bucketCount; ++i) {
+                const auto count = counts[i].load(std::memory_order_relaxed);
+                histogram.counts[i] += count;
+                histogram.total += count;
+            }
+            histogram.sum += sum.load(std::memory_order_relaxed);
+            histogram.maximum = std::max(histogram.maximum, maximum.load(std::memory_order_relaxed));
+        }
+
+    private:
+        std::array<std::atomic<uint64_t>, Histogram::bucketCount> counts = {};
+        std::atomic<uint64_t> sum{0};
+        std::atomic<uint64_t> maximum{0};
+    };
+
+    struct alignas(64) Counters {
+        std::atomic<uint64_t> callsSent{0};
+        std::atomic<uint64_t> callsReceived{0};
+        std::atomic<uint64_t> resultsSent{0};
+        std::atomic<uint64_t> resultsReceived{0};
+        std::atomic<uint64_t> cancelsSent{0};
+        std::atomic<uint64_t> cancelsReceived{0};
+        std::atomic<uint64_t> bytesSent{0};
+        std::atomic<uint64_t> bytesReceived{0};
+        AtomicHistogram handlerTime;
+        AtomicHistogram latency;
+
+        std::atomic<uint64_t>& sent(CallType callType) {
+            return callType == CallType::Call ? callsSent : callType == CallType::Response ? resultsSent : cancelsSent;
+        }
+
+        std::atomic<uint64_t>& received(CallType callType) {
+            return callType == CallType::Call ? callsReceived : callType == CallType::Response ? resultsReceived : cancelsReceived;
+        }
+    };
+
+    struct StartTime {
+        std::atomic<CallId> callId{0};
+        std::atomic<int64_t> time{0};
+    };
+
+    static int64_t now() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    void startCall(CallId callId, int64_t time) {
+        auto& start = startTimes[callId & (LatencySlots - 1)];
+        start.time.store(time, std::memory_order_relaxed);
+        start.callId.store(callId, std::memory_order_release);
+    }
+
+    static std::size_t shardIndex() {
+        static std::atomic<std::size_t> threads{0};
+        thread_local const std::size_t index = threads.fetch_add(1, std::memory_order_relaxed) % Shards;
+        return index;
+    }
+
+    Counters& local(FunctionId functionId) {
+        assert(functionId < indices.size() && indices[functionId] != noIndex);
+        return functions[indices[functionId]].shards[shardIndex()];
+    }
+
+    struct Function {
+        FunctionId functionId;
+        std::unique_ptr<Counters[]> shards; // adjacent
+    };
+
+    static constexpr uint16_t noIndex = ~uint16_t(0);
+
+    // FunctionIds may be sparse (see `rpc::Named`), `indices` maps them to `functions`.
+    // The set of functions does not change after construction
+    std::vector<uint16_t> indices;
+    std::vector<Function> functions;
+    std::unique_ptr<StartTime[]> startTimes;
+};
+
+} // namespace rpc